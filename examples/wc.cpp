@@ -1,36 +1,39 @@
-#include <iostream>
-#include <string>
-#include <functional>
+#include <cctype>
+#include <cstdint>
+#include "../include/job.hpp"
 
-extern "C" void map(const char* c_str_input, void (*emit) (const char*, const char*)) {
-    std::string input(c_str_input);
-    const size_t& n = input.size();
+// Words are emitted straight out of the input without copying them, and counts are shuffled as
+// 8-byte integers rather than as text
+struct Map {
+    void operator()(std::string_view input, mapreduce::Emitter<std::string_view, uint64_t>& emit) const {
+        for (size_t i = 0; i < input.size(); ++i) {
+            // Skip past leading whitespace
+            while (i < input.size() && isspace(input[i]))
+                ++i;
 
-    std::string word;
-    for (size_t i = 0; i < n; ++i) {
-        // Skip past leading whitespace
-        while (i < n && isspace(input[i]))
-            ++i;
+            // Start of the word
+            size_t start = i;
+            while (i < input.size() && !isspace(input[i]))
+                i++;
 
-        // Start of the word
-        size_t start = i;
-        while (i < n && !isspace(input[i]))
-            i++;
+            if (start < i)
+                emit(input.substr(start, i - start), 1);
+        }
+    }
+};
 
-        // Emit the word
-        if (start < i)
-            emit(input.substr(start, i - start).c_str(), "1");
+// Sum all the counts. Partial counts are summed the same way, so it doubles as the combiner.
+struct Sum {
+    void operator()(std::string_view word, const mapreduce::Values<uint64_t>& counts,
+                    mapreduce::Emitter<std::string_view, uint64_t>& emit) const {
+        uint64_t count = 0;
+        for (uint64_t partial : counts)
+            count += partial;
+        emit(word, count);
     }
-}
+};
 
-extern "C" void reduce(const char* key, const char* const* values, int values_len, void (*emit)(const char*, const char*)) {
-    int count = 0;
+using WordCount = mapreduce::Job<std::string_view, uint64_t, Map, Sum, Sum>;
 
-    // Sum all the values
-    for (int i = 0; i < values_len; ++i) {
-        count += std::stoi(values[i]);
-    }
-    
-    // Emit the sum
-    emit(key, std::to_string(count).c_str());
-}
+MAPREDUCE_EXPORT_JOB(WordCount)
+MAPREDUCE_EXPORT_COMBINER(WordCount)
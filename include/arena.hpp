@@ -0,0 +1,72 @@
+//
+// Bump allocator for the records buffered by a task.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_ARENA_HPP
+#define MAPREDUCE_ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string_view>
+
+namespace mapreduce {
+    // Hands out memory as offsets into a single growable buffer. Records refer to their bytes
+    // by (offset, length), so they stay valid when the buffer grows, and everything is freed at
+    // once by reset(), which keeps the buffer for reuse.
+    class Arena {
+    public:
+        explicit Arena(size_t initial_capacity = 1024 * 1024) : initial_capacity(initial_capacity) { }
+
+        // Copy the bytes into the arena followed by a NUL, and return their offset
+        size_t append(std::string_view bytes) {
+            size_t offset = allocate(bytes.size() + 1);
+            std::memcpy(this->buffer.get() + offset, bytes.data(), bytes.size());
+            this->buffer[offset + bytes.size()] = '\0';
+            return offset;
+        }
+
+        size_t allocate(size_t n) {
+            if (this->used + n > this->capacity) {
+                grow(this->used + n);
+            }
+            size_t offset = this->used;
+            this->used += n;
+            return offset;
+        }
+
+        std::string_view view(size_t offset, size_t length) const {
+            return std::string_view(this->buffer.get() + offset, length);
+        }
+
+        // Number of bytes handed out since the last reset
+        size_t size() const {
+            return this->used;
+        }
+
+        void reset() {
+            this->used = 0;
+        }
+
+    private:
+        void grow(size_t min_capacity) {
+            size_t new_capacity = std::max({min_capacity, this->capacity * 2, this->initial_capacity});
+            std::unique_ptr<char[]> new_buffer(new char[new_capacity]);
+            if (this->used > 0) {
+                std::memcpy(new_buffer.get(), this->buffer.get(), this->used);
+            }
+            this->buffer = std::move(new_buffer);
+            this->capacity = new_capacity;
+        }
+
+        std::unique_ptr<char[]> buffer;
+        size_t capacity = 0;
+        size_t used = 0;
+        size_t initial_capacity;
+    };
+}
+
+#endif //MAPREDUCE_ARENA_HPP
@@ -0,0 +1,146 @@
+//
+// Block compression codecs for intermediate files.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_COMPRESSION_HPP
+#define MAPREDUCE_COMPRESSION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Every codec is optional, the build defines MAPREDUCE_HAVE_<CODEC> for the libraries it found
+#ifdef MAPREDUCE_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef MAPREDUCE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef MAPREDUCE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace mapreduce {
+    // Codec of the blocks of an intermediate file. LZ4 is the fastest and is meant for jobs
+    // bound by disk or network bandwidth, ZSTD and ZLIB compress better at a higher CPU cost.
+    // The values are stored in the file header, so they must not change.
+    enum class Compression : uint8_t {
+        NONE = 0,
+        LZ4 = 1,
+        ZSTD = 2,
+        ZLIB = 3
+    };
+
+    inline const char* compressionName(Compression codec) {
+        switch (codec) {
+            case Compression::LZ4: return "lz4";
+            case Compression::ZSTD: return "zstd";
+            case Compression::ZLIB: return "zlib";
+            default: return "none";
+        }
+    }
+
+    // Parse a codec name as returned by compressionName(), an empty name is NONE. Returns
+    // false if the name is unknown.
+    inline bool parseCompression(std::string_view name, Compression& codec) {
+        for (Compression candidate : {Compression::NONE, Compression::LZ4, Compression::ZSTD, Compression::ZLIB}) {
+            if (name == compressionName(candidate)) {
+                codec = candidate;
+                return true;
+            }
+        }
+        if (name.empty()) {
+            codec = Compression::NONE;
+            return true;
+        }
+        return false;
+    }
+
+    // True if the codec was compiled in
+    inline bool compressionAvailable(Compression codec) {
+        switch (codec) {
+            case Compression::NONE: return true;
+#ifdef MAPREDUCE_HAVE_LZ4
+            case Compression::LZ4: return true;
+#endif
+#ifdef MAPREDUCE_HAVE_ZSTD
+            case Compression::ZSTD: return true;
+#endif
+#ifdef MAPREDUCE_HAVE_ZLIB
+            case Compression::ZLIB: return true;
+#endif
+            default: return false;
+        }
+    }
+
+    // Compress a block into out. Returns false if the codec is not available or failed, the
+    // block is then stored uncompressed. The buffers are unused if no codec was compiled in.
+    inline bool compressBlock(Compression codec, [[maybe_unused]] std::string_view in, [[maybe_unused]] std::string& out) {
+        switch (codec) {
+#ifdef MAPREDUCE_HAVE_LZ4
+            case Compression::LZ4: {
+                out.resize(LZ4_compressBound(static_cast<int>(in.size())));
+                int size = LZ4_compress_default(in.data(), out.data(), static_cast<int>(in.size()), static_cast<int>(out.size()));
+                out.resize(size > 0 ? size : 0);
+                return size > 0;
+            }
+#endif
+#ifdef MAPREDUCE_HAVE_ZSTD
+            case Compression::ZSTD: {
+                out.resize(ZSTD_compressBound(in.size()));
+                size_t size = ZSTD_compress(out.data(), out.size(), in.data(), in.size(), ZSTD_CLEVEL_DEFAULT);
+                if (ZSTD_isError(size)) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#endif
+#ifdef MAPREDUCE_HAVE_ZLIB
+            case Compression::ZLIB: {
+                uLongf size = compressBound(in.size());
+                out.resize(size);
+                if (compress2(reinterpret_cast<Bytef*>(out.data()), &size, reinterpret_cast<const Bytef*>(in.data()),
+                              in.size(), Z_BEST_SPEED) != Z_OK) {
+                    return false;
+                }
+                out.resize(size);
+                return true;
+            }
+#endif
+            default:
+                return false;
+        }
+    }
+
+    // Decompress a block that is raw_size bytes long uncompressed into out. Returns false if
+    // the codec is not available or the block is corrupt.
+    inline bool decompressBlock(Compression codec, [[maybe_unused]] std::string_view in, size_t raw_size, std::string& out) {
+        out.resize(raw_size);
+        switch (codec) {
+#ifdef MAPREDUCE_HAVE_LZ4
+            case Compression::LZ4:
+                return LZ4_decompress_safe(in.data(), out.data(), static_cast<int>(in.size()), static_cast<int>(raw_size))
+                    == static_cast<int>(raw_size);
+#endif
+#ifdef MAPREDUCE_HAVE_ZSTD
+            case Compression::ZSTD:
+                return ZSTD_decompress(out.data(), raw_size, in.data(), in.size()) == raw_size;
+#endif
+#ifdef MAPREDUCE_HAVE_ZLIB
+            case Compression::ZLIB: {
+                uLongf size = raw_size;
+                return uncompress(reinterpret_cast<Bytef*>(out.data()), &size, reinterpret_cast<const Bytef*>(in.data()),
+                                  in.size()) == Z_OK && size == raw_size;
+            }
+#endif
+            default:
+                return false;
+        }
+    }
+}
+
+#endif //MAPREDUCE_COMPRESSION_HPP
@@ -0,0 +1,141 @@
+//
+// Writing the output of the reduce tasks into the job's final output file.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_FINAL_OUTPUT_HPP
+#define MAPREDUCE_FINAL_OUTPUT_HPP
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "intermediate.hpp"
+
+namespace mapreduce {
+    // Writes lines of text to a stream. Lines are appended to a buffer, and a full buffer is
+    // handed to a background thread that writes it, so that reading and merging the records
+    // overlaps with the writes.
+    class TextOutputWriter {
+    public:
+        explicit TextOutputWriter(std::ostream& out, size_t buffer_size = 1024 * 1024)
+            : out(out), buffer_size(buffer_size), thread([this] { writeLoop(); }) {
+            this->buffer.reserve(buffer_size + 1024);
+        }
+
+        ~TextOutputWriter() {
+            close();
+        }
+
+        void write(std::string_view line) {
+            this->buffer.append(line).append(1, '\n');
+            if (this->buffer.size() >= this->buffer_size) {
+                handOff();
+            }
+        }
+
+        // Write the last buffer and wait for the writes, returns false if one failed
+        bool close() {
+            if (this->thread.joinable()) {
+                handOff();
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->closing = true;
+                }
+                this->changed.notify_all();
+                this->thread.join();
+                this->out.flush();
+            }
+            return !this->out.fail();
+        }
+
+    private:
+        // Wait until the previous buffer is written, then hand the current one to the writer thread
+        void handOff() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->changed.wait(lock, [this] { return this->pending.empty(); });
+            this->pending.swap(this->buffer);
+            this->buffer.clear();
+            lock.unlock();
+            this->changed.notify_all();
+        }
+
+        void writeLoop() {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            for (;;) {
+                this->changed.wait(lock, [this] { return !this->pending.empty() || this->closing; });
+                if (this->pending.empty()) {
+                    return; // Closing, and every buffer has been written
+                }
+                // The buffer is not touched by the formatting thread until it is emptied
+                lock.unlock();
+                this->out.write(this->pending.data(), this->pending.size());
+                lock.lock();
+                this->pending.clear();
+                this->changed.notify_all();
+            }
+        }
+
+        std::ostream& out;
+        size_t buffer_size;
+        std::string buffer; // Being formatted
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::string pending; // Being written, empty once the writer thread is done with it
+        bool closing = false;
+        std::thread thread; // Declared last, so that it starts once the other members are initialized
+    };
+
+    // Reduce outputs hold a record per emitted pair, keyed by the reduce input key it was emitted
+    // for, with the "key\tvalue" line as its value, see outputLine. The key is in the order of the
+    // intermediate records, which for typed jobs is the order of the values rather than of their
+    // text (10 after 9).
+    inline void outputLine(std::string& line, std::string_view key, std::string_view value) {
+        line.assign(key).append(1, '\t').append(value);
+    }
+
+    // Write the lines of the reduce outputs to out. The outputs are concatenated in order if the
+    // partitions are already ordered with respect to each other (range partitioned, or not sorted
+    // at all), and merged in the given order otherwise, so that the final output is sorted by the
+    // reduce input keys. Either way the records are streamed, only a block of every output is
+    // held in memory. Returns false if the text could not be written.
+    inline bool writeFinalOutput(std::vector<std::unique_ptr<RecordSource>> sources, std::ostream& out, bool concatenate,
+                                 KeyOrder order = KeyOrder::BYTES) {
+        TextOutputWriter writer(out);
+        if (concatenate) {
+            for (auto& source : sources) {
+                while (source->next()) {
+                    writer.write(source->value());
+                }
+            }
+        } else {
+            MergeIterator merge(std::move(sources), order);
+            while (merge.next()) {
+                writer.write(merge.value());
+            }
+        }
+        return writer.close();
+    }
+
+    // Same as above for reduce outputs written to files, also returns false if one of them
+    // could not be opened
+    inline bool writeFinalOutput(const std::vector<std::string>& filenames, std::ostream& out, bool concatenate,
+                                 KeyOrder order = KeyOrder::BYTES) {
+        std::vector<std::unique_ptr<RecordSource>> sources;
+        for (const auto& filename : filenames) {
+            auto reader = std::make_unique<RecordReader>(filename);
+            if (!reader->is_open()) {
+                return false;
+            }
+            sources.push_back(std::move(reader));
+        }
+        return writeFinalOutput(std::move(sources), out, concatenate, order);
+    }
+}
+
+#endif //MAPREDUCE_FINAL_OUTPUT_HPP
@@ -0,0 +1,49 @@
+//
+// Byte ranges of the input files processed by map tasks.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_INPUT_SPLIT_HPP
+#define MAPREDUCE_INPUT_SPLIT_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace mapreduce {
+    // A byte range of an input file. Splits are cut at fixed offsets without looking at the
+    // data, and the reader aligns them to record (line) boundaries.
+    struct InputSplit {
+        std::string filename;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // Returns the records of the split [offset, offset + length) of a file: every line that
+    // starts inside the split, including the end of the last one even if it runs past the
+    // split. Lines that start in the previous split are skipped, so every line of the file
+    // belongs to exactly one split.
+    inline std::string_view splitRecords(std::string_view file, uint64_t offset, uint64_t length) {
+        if (offset >= file.size()) {
+            return {};
+        }
+
+        // A line starts at p if p is 0 or follows a newline
+        size_t begin = 0;
+        if (offset > 0) {
+            begin = file.find('\n', offset - 1);
+            begin = begin == std::string_view::npos ? file.size() : begin + 1;
+        }
+
+        size_t end = file.size();
+        if (offset + length < file.size()) {
+            end = file.find('\n', offset + length - 1);
+            end = end == std::string_view::npos ? file.size() : end + 1;
+        }
+
+        return begin < end ? file.substr(begin, end - begin) : std::string_view();
+    }
+}
+
+#endif //MAPREDUCE_INPUT_SPLIT_HPP
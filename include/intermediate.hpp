@@ -0,0 +1,462 @@
+//
+// Reading, writing and merging runs of intermediate key-value records.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_INTERMEDIATE_HPP
+#define MAPREDUCE_INTERMEDIATE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compression.hpp"
+#include "partition.hpp"
+
+namespace mapreduce {
+    // Intermediate files are a header followed by a sequence of blocks:
+    //
+    //   file   := magic "MRI1" | flags (1 byte) | block*
+    //   block  := varint payload_size | varint num_records | [varint raw_size] | [crc32 of payload, 4 bytes LE] | payload
+    //   records:= (varint key_len | varint value_len | key | value)*
+    //
+    // Keys and values are length-prefixed, so they can contain any byte. The low bit of the
+    // flags is the checksum flag, and the high 4 bits are the Compression of the blocks. The
+    // payload is the records, compressed if the file is compressed and raw_size, the size of
+    // the records, is not equal to payload_size; blocks that don't shrink are stored as is.
+    // The checksum covers the payload as stored, and is only present with the checksum flag.
+    constexpr char intermediate_magic[4] = {'M', 'R', 'I', '1'};
+    constexpr uint8_t intermediate_flag_checksum = 1;
+    constexpr int intermediate_compression_shift = 4;
+
+    // Order of the records of a sorted run. BYTES sorts by key. HASH sorts by the hash of the
+    // key and then by key, which still brings equal keys together for the reduce tasks but
+    // mostly compares integers, so it is faster when the job doesn't need sorted output.
+    enum class KeyOrder {
+        BYTES,
+        HASH
+    };
+
+    struct WriterOptions {
+        bool checksums = false;
+        size_t block_size = 64 * 1024;
+        KeyOrder key_order = KeyOrder::BYTES; // Order of the runs that are written and merged
+        Compression compression = Compression::NONE; // Blocks are stored uncompressed if the codec is not available
+    };
+
+    // A 64-bit prefix of the sort order of a key. Keys with different prefixes are ordered by
+    // their prefix, so the keys only have to be compared when the prefixes are equal. For BYTES
+    // it is the first 8 bytes of the key, big-endian and zero-padded.
+    inline uint64_t orderPrefix(KeyOrder order, std::string_view key) {
+        if (order == KeyOrder::HASH) {
+            return hashKey(key);
+        }
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < 8; i++) {
+            prefix = (prefix << 8) | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+        }
+        return prefix;
+    }
+
+    namespace detail {
+        constexpr std::array<uint32_t, 256> makeCrc32Table() {
+            std::array<uint32_t, 256> table{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+                }
+                table[i] = c;
+            }
+            return table;
+        }
+
+        constexpr std::array<uint32_t, 256> crc32_table = makeCrc32Table();
+
+        inline void putVarint(std::string& out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>(value | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        // Decode a varint from [pos, end), returns false if it is truncated
+        inline bool getVarint(const char*& pos, const char* end, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; pos < end && shift < 64; shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(*pos++);
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        inline bool readVarint(std::istream& in, uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                int byte = in.get();
+                if (byte == std::char_traits<char>::eof()) {
+                    return false;
+                }
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    // CRC-32 (IEEE) of a buffer
+    inline uint32_t crc32(std::string_view data) {
+        uint32_t crc = 0xFFFFFFFFU;
+        for (unsigned char c : data) {
+            crc = detail::crc32_table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFU;
+    }
+
+    // Writes key-value records to an intermediate file. Records are appended to an in-memory
+    // block, and the block is written out with a single write once it is full.
+    class RecordWriter {
+    public:
+        explicit RecordWriter(const std::string& filename, WriterOptions options = {})
+            : file(filename, std::ios::binary | std::ios::trunc), options(options) {
+            if (this->file.is_open()) {
+                this->file.write(intermediate_magic, sizeof(intermediate_magic));
+                this->file.put(static_cast<char>((options.checksums ? intermediate_flag_checksum : 0)
+                                                 | static_cast<uint8_t>(options.compression) << intermediate_compression_shift));
+                this->num_bytes = sizeof(intermediate_magic) + 1;
+            }
+            this->block.reserve(options.block_size + 1024);
+        }
+
+        ~RecordWriter() {
+            close();
+        }
+
+        bool is_open() const {
+            return this->file.is_open();
+        }
+
+        void write(std::string_view key, std::string_view value) {
+            detail::putVarint(this->block, key.size());
+            detail::putVarint(this->block, value.size());
+            this->block.append(key);
+            this->block.append(value);
+            this->num_records++;
+            this->block_records++;
+            if (this->block.size() >= this->options.block_size) {
+                flushBlock();
+            }
+        }
+
+        size_t records() const {
+            return this->num_records;
+        }
+
+        // Bytes written to the file so far, the last block is only written by close()
+        size_t bytes() const {
+            return this->num_bytes;
+        }
+
+        // Flush the last block and close the file, returns false if a write failed
+        bool close() {
+            if (!this->file.is_open()) {
+                return this->good;
+            }
+            flushBlock();
+            this->file.close();
+            this->good = this->good && !this->file.fail();
+            return this->good;
+        }
+
+    private:
+        void flushBlock() {
+            if (this->block_records == 0) {
+                return;
+            }
+            std::string_view payload = this->block;
+            const bool compressed = this->options.compression != Compression::NONE
+                && compressBlock(this->options.compression, this->block, this->compressed)
+                && this->compressed.size() < this->block.size();
+            if (compressed) {
+                payload = this->compressed;
+            }
+
+            std::string header;
+            detail::putVarint(header, payload.size());
+            detail::putVarint(header, this->block_records);
+            if (this->options.compression != Compression::NONE) {
+                detail::putVarint(header, this->block.size());
+            }
+            if (this->options.checksums) {
+                uint32_t crc = crc32(payload);
+                for (int i = 0; i < 4; i++) {
+                    header.push_back(static_cast<char>(crc >> (8 * i)));
+                }
+            }
+            this->file.write(header.data(), header.size());
+            this->file.write(payload.data(), payload.size());
+            this->num_bytes += header.size() + payload.size();
+            this->good = this->good && !this->file.fail();
+            this->block.clear();
+            this->block_records = 0;
+        }
+
+        std::ofstream file;
+        WriterOptions options;
+        std::string block;
+        std::string compressed; // Compressed copy of the block, kept to reuse its memory
+        size_t block_records = 0;
+        size_t num_records = 0;
+        size_t num_bytes = 0;
+        bool good = true;
+    };
+
+    // A stream of key-value records. The views returned by key() and value() are only valid
+    // until the next call to next().
+    class RecordSource {
+    public:
+        virtual ~RecordSource() = default;
+
+        // Advance to the next record, returns false once the source is exhausted
+        virtual bool next() = 0;
+        virtual std::string_view key() const = 0;
+        virtual std::string_view value() const = 0;
+    };
+
+    // Reads the records of an intermediate file written by RecordWriter. A whole block is read
+    // and decompressed at a time, and the keys and values are views into the block, so no
+    // record is copied. Throws std::runtime_error if the file is corrupt, or compressed with a
+    // codec that is not available.
+    class RecordReader : public RecordSource {
+    public:
+        explicit RecordReader(const std::string& filename) : filename(filename), file(filename, std::ios::binary) {
+            if (!this->file.is_open()) {
+                return;
+            }
+            char header[sizeof(intermediate_magic) + 1];
+            if (!this->file.read(header, sizeof(header))
+                || !std::equal(intermediate_magic, intermediate_magic + sizeof(intermediate_magic), header)) {
+                throw std::runtime_error("not an intermediate file: " + filename);
+            }
+            const uint8_t flags = header[sizeof(intermediate_magic)];
+            this->checksums = flags & intermediate_flag_checksum;
+            this->compression = static_cast<Compression>(flags >> intermediate_compression_shift);
+        }
+
+        bool is_open() const {
+            return this->file.is_open();
+        }
+
+        bool next() override {
+            while (this->block_records == 0) {
+                if (!readBlock()) {
+                    return false;
+                }
+            }
+
+            uint64_t key_len, value_len;
+            const char* end = this->block.data() + this->block.size();
+            if (!detail::getVarint(this->pos, end, key_len)
+                || !detail::getVarint(this->pos, end, value_len)
+                || static_cast<uint64_t>(end - this->pos) < key_len + value_len) {
+                throw std::runtime_error("truncated record in " + this->filename);
+            }
+            this->current_key = std::string_view(this->pos, key_len);
+            this->current_value = std::string_view(this->pos + key_len, value_len);
+            this->pos += key_len + value_len;
+            this->block_records--;
+            return true;
+        }
+
+        std::string_view key() const override {
+            return this->current_key;
+        }
+
+        std::string_view value() const override {
+            return this->current_value;
+        }
+
+    private:
+        bool readBlock() {
+            uint64_t payload_size;
+            if (!detail::readVarint(this->file, payload_size)) {
+                return false; // End of file
+            }
+            if (!detail::readVarint(this->file, this->block_records)) {
+                throw std::runtime_error("truncated block header in " + this->filename);
+            }
+            uint64_t raw_size = payload_size;
+            if (this->compression != Compression::NONE && !detail::readVarint(this->file, raw_size)) {
+                throw std::runtime_error("truncated block header in " + this->filename);
+            }
+            uint32_t expected_crc = 0;
+            if (this->checksums) {
+                unsigned char crc[4];
+                if (!this->file.read(reinterpret_cast<char*>(crc), sizeof(crc))) {
+                    throw std::runtime_error("truncated block header in " + this->filename);
+                }
+                expected_crc = crc[0] | (crc[1] << 8) | (crc[2] << 16) | (static_cast<uint32_t>(crc[3]) << 24);
+            }
+
+            // A block that didn't shrink is stored uncompressed, and is read straight into the block
+            const bool compressed = raw_size != payload_size;
+            std::string& payload = compressed ? this->compressed : this->block;
+            payload.resize(payload_size);
+            if (!this->file.read(payload.data(), payload_size)) {
+                throw std::runtime_error("truncated block in " + this->filename);
+            }
+            if (this->checksums && crc32(payload) != expected_crc) {
+                throw std::runtime_error("checksum mismatch in " + this->filename);
+            }
+            if (compressed) {
+                if (!compressionAvailable(this->compression)) {
+                    throw std::runtime_error(std::string("unsupported compression ") + compressionName(this->compression)
+                                             + " in " + this->filename);
+                }
+                if (!decompressBlock(this->compression, payload, raw_size, this->block)) {
+                    throw std::runtime_error("corrupt compressed block in " + this->filename);
+                }
+            }
+            this->pos = this->block.data();
+            return true;
+        }
+
+        std::string filename;
+        std::ifstream file;
+        bool checksums = false;
+        Compression compression = Compression::NONE;
+        std::string block;
+        std::string compressed; // Compressed payload of the block, kept to reuse its memory
+        const char* pos = nullptr;
+        uint64_t block_records = 0;
+        std::string_view current_key;
+        std::string_view current_value;
+    };
+
+    // Streaming k-way merge of sorted record sources. Only the current record of every source
+    // is held in memory, so the merged runs can be larger than RAM. Records with equal keys are
+    // returned in the order of their sources. The sources must all be sorted in the given order.
+    class MergeIterator : public RecordSource {
+    public:
+        explicit MergeIterator(std::vector<std::unique_ptr<RecordSource>> sources, KeyOrder order = KeyOrder::BYTES)
+            : sources(std::move(sources)), order(order), prefixes(this->sources.size()), heap(Greater{this}) {
+            for (size_t i = 0; i < this->sources.size(); i++) {
+                advance(i);
+            }
+        }
+
+        bool next() override {
+            // The current record is consumed, so its source can be advanced
+            if (this->current < this->sources.size()) {
+                advance(this->current);
+            }
+            if (this->heap.empty()) {
+                this->current = this->sources.size();
+                return false;
+            }
+            this->current = this->heap.top();
+            this->heap.pop();
+            return true;
+        }
+
+        std::string_view key() const override {
+            return this->sources[this->current]->key();
+        }
+
+        std::string_view value() const override {
+            return this->sources[this->current]->value();
+        }
+
+    private:
+        // Move a source to its next record, and put it back in the heap if it has one
+        void advance(size_t i) {
+            if (this->sources[i]->next()) {
+                this->prefixes[i] = orderPrefix(this->order, this->sources[i]->key());
+                this->heap.push(i);
+            }
+        }
+
+        struct Greater {
+            const MergeIterator* merge;
+            bool operator()(size_t a, size_t b) const {
+                uint64_t prefix_a = merge->prefixes[a], prefix_b = merge->prefixes[b];
+                if (prefix_a != prefix_b) {
+                    return prefix_a > prefix_b;
+                }
+                int cmp = merge->sources[a]->key().compare(merge->sources[b]->key());
+                return cmp > 0 || (cmp == 0 && a > b);
+            }
+        };
+
+        std::vector<std::unique_ptr<RecordSource>> sources;
+        KeyOrder order;
+        std::vector<uint64_t> prefixes; // Order prefix of the current key of every source
+        std::priority_queue<size_t, std::vector<size_t>, Greater> heap;
+        size_t current = SIZE_MAX;
+    };
+
+    // Merge sorted runs into a single sorted run. Returns false if a run could not be opened or
+    // the output could not be written.
+    inline bool mergeRuns(const std::vector<std::string>& input_filenames, const std::string& output_filename, WriterOptions options) {
+        std::vector<std::unique_ptr<RecordSource>> sources;
+        for (const auto& filename : input_filenames) {
+            auto reader = std::make_unique<RecordReader>(filename);
+            if (!reader->is_open()) {
+                return false;
+            }
+            sources.push_back(std::move(reader));
+        }
+
+        RecordWriter writer(output_filename, options);
+        if (!writer.is_open()) {
+            return false;
+        }
+        MergeIterator merge(std::move(sources), options.key_order);
+        while (merge.next()) {
+            writer.write(merge.key(), merge.value());
+        }
+        return writer.close();
+    }
+
+    // Calls func(key, values) once per distinct key of a sorted record source. The values are
+    // copied out of the source, and both the key and the values are NUL-terminated.
+    template <typename Func>
+    void groupByKey(RecordSource& source, Func func) {
+        std::string key;
+        std::vector<std::string> values; // Reused across keys to avoid reallocating the strings
+        std::vector<std::string_view> views;
+
+        bool has_record = source.next();
+        while (has_record) {
+            key.assign(source.key());
+            size_t num_values = 0;
+            do {
+                if (num_values < values.size()) {
+                    values[num_values].assign(source.value());
+                } else {
+                    values.emplace_back(source.value());
+                }
+                num_values++;
+                has_record = source.next();
+            } while (has_record && source.key() == key);
+
+            views.assign(values.begin(), values.begin() + num_values);
+            func(std::string_view(key), views);
+        }
+    }
+}
+
+#endif //MAPREDUCE_INTERMEDIATE_HPP
@@ -0,0 +1,258 @@
+//
+// Typed map/reduce functions, exported to the worker through the C ABI of mapreduce_abi.h.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_JOB_HPP
+#define MAPREDUCE_JOB_HPP
+
+#include <bit>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "mapreduce_abi.h"
+
+namespace mapreduce {
+    // Converts keys and values of type T to and from the bytes of the intermediate records, and
+    // to the text of the final output. Specializations provide:
+    //
+    //   static std::string_view encode(const T& value, std::string& buffer);
+    //   static T decode(std::string_view bytes);
+    //   static std::string_view format(const T& value, std::string& buffer);
+    //
+    // encode and format may return a view of the value itself, or write to the buffer and
+    // return a view of it. Encoded keys compare as bytes in the same order as the values, so
+    // that the intermediate records, and the final output, are sorted by value. decode throws
+    // std::runtime_error on bytes that are not an encoded value, which fails the task.
+    template <typename T, typename Enable = void>
+    struct Serializer;
+
+    // Integers are encoded big-endian with the sign bit flipped, in sizeof(T) bytes
+    template <typename T>
+    struct Serializer<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+        using Bits = std::make_unsigned_t<T>;
+
+        static std::string_view encode(T value, std::string& buffer) {
+            return encodeBits(flipSign(static_cast<Bits>(value)), buffer);
+        }
+
+        static T decode(std::string_view bytes) {
+            return static_cast<T>(flipSign(decodeBits(bytes)));
+        }
+
+        static std::string_view format(T value, std::string& buffer) {
+            buffer.resize(24);
+            auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+            return std::string_view(buffer.data(), result.ptr - buffer.data());
+        }
+
+        static std::string_view encodeBits(Bits bits, std::string& buffer) {
+            buffer.resize(sizeof(Bits));
+            for (size_t i = 0; i < sizeof(Bits); i++) {
+                buffer[i] = static_cast<char>(bits >> (8 * (sizeof(Bits) - 1 - i)));
+            }
+            return buffer;
+        }
+
+        static Bits decodeBits(std::string_view bytes) {
+            if (bytes.size() != sizeof(Bits)) {
+                throw std::runtime_error("cannot decode " + std::to_string(bytes.size()) + " bytes as a "
+                                         + std::to_string(sizeof(Bits)) + " byte number");
+            }
+            Bits bits = 0;
+            for (unsigned char c : bytes) {
+                bits = static_cast<Bits>(bits << 8) | c;
+            }
+            return bits;
+        }
+
+    private:
+        // Negative values sort before positive ones
+        static Bits flipSign(Bits bits) {
+            if constexpr (std::is_signed_v<T>) {
+                return bits ^ (Bits(1) << (8 * sizeof(Bits) - 1));
+            }
+            return bits;
+        }
+    };
+
+    // Floating point numbers are encoded like integers, with the bits of negative numbers
+    // flipped so that they sort in reverse
+    template <typename T>
+    struct Serializer<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+        using Bits = std::conditional_t<sizeof(T) == 4, uint32_t, uint64_t>;
+        static_assert(sizeof(T) == sizeof(Bits), "unsupported floating point type");
+        static constexpr Bits sign = Bits(1) << (8 * sizeof(Bits) - 1);
+
+        static std::string_view encode(T value, std::string& buffer) {
+            Bits bits = std::bit_cast<Bits>(value);
+            bits = (bits & sign) ? ~bits : bits ^ sign;
+            return Serializer<Bits>::encodeBits(bits, buffer);
+        }
+
+        static T decode(std::string_view bytes) {
+            Bits bits = Serializer<Bits>::decodeBits(bytes);
+            bits = (bits & sign) ? bits ^ sign : ~bits;
+            return std::bit_cast<T>(bits);
+        }
+
+        static std::string_view format(T value, std::string& buffer) {
+            buffer.resize(64);
+            auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value);
+            return std::string_view(buffer.data(), result.ptr - buffer.data());
+        }
+    };
+
+    // Strings are their own bytes
+    template <>
+    struct Serializer<std::string> {
+        static std::string_view encode(const std::string& value, std::string&) {
+            return value;
+        }
+
+        static std::string decode(std::string_view bytes) {
+            return std::string(bytes);
+        }
+
+        static std::string_view format(const std::string& value, std::string&) {
+            return value;
+        }
+    };
+
+    // Like std::string, without copies. Decoded views are only valid during the call they are
+    // passed to.
+    template <>
+    struct Serializer<std::string_view> {
+        static std::string_view encode(std::string_view value, std::string&) {
+            return value;
+        }
+
+        static std::string_view decode(std::string_view bytes) {
+            return bytes;
+        }
+
+        static std::string_view format(std::string_view value, std::string&) {
+            return value;
+        }
+    };
+
+    // Passed to the map, combine and reduce functions to emit typed key-value pairs. The pairs
+    // emitted by map and combine are encoded, those emitted by reduce are formatted as text for
+    // the final output.
+    template <typename K, typename V>
+    class Emitter {
+    public:
+        Emitter(void* ctx, mr_emit_t emit, bool text) : ctx(ctx), emit(emit), text(text) { }
+
+        void operator()(const K& key, const V& value) {
+            std::string_view key_bytes = this->text
+                ? Serializer<K>::format(key, this->key_buffer) : Serializer<K>::encode(key, this->key_buffer);
+            std::string_view value_bytes = this->text
+                ? Serializer<V>::format(value, this->value_buffer) : Serializer<V>::encode(value, this->value_buffer);
+            this->emit(this->ctx, key_bytes.data(), key_bytes.size(), value_bytes.data(), value_bytes.size());
+        }
+
+    private:
+        void* ctx;
+        mr_emit_t emit;
+        bool text;
+        std::string key_buffer;
+        std::string value_buffer;
+    };
+
+    // The values of a key, decoded as they are iterated
+    template <typename V>
+    class Values {
+    public:
+        class iterator {
+        public:
+            explicit iterator(const mr_slice* slice) : slice(slice) { }
+
+            V operator*() const {
+                return Serializer<V>::decode(std::string_view(this->slice->data, this->slice->len));
+            }
+
+            iterator& operator++() {
+                ++this->slice;
+                return *this;
+            }
+
+            bool operator==(const iterator& other) const = default;
+
+        private:
+            const mr_slice* slice;
+        };
+
+        Values(const mr_slice* values, size_t values_len) : values(values), values_len(values_len) { }
+
+        iterator begin() const {
+            return iterator(this->values);
+        }
+
+        iterator end() const {
+            return iterator(this->values + this->values_len);
+        }
+
+        size_t size() const {
+            return this->values_len;
+        }
+
+    private:
+        const mr_slice* values;
+        size_t values_len;
+    };
+
+    // A job with keys of type K and values of type V, each with a Serializer. The functions are
+    // default-constructible function objects (such as captureless lambdas) called as:
+    //
+    //   MapFn{}(std::string_view input, Emitter<K, V>& emit)
+    //   ReduceFn{}(const K& key, const Values<V>& values, Emitter<K, V>& emit)
+    //   CombineFn{}(const K& key, const Values<V>& values, Emitter<K, V>& emit)
+    //
+    // As the types are known at compile time, the intermediate values are shuffled in their
+    // binary encoding, and are only formatted as text by reduce. Export the job from a shared
+    // object with MAPREDUCE_EXPORT_JOB, and MAPREDUCE_EXPORT_COMBINER if it has a combiner.
+    template <typename K, typename V, typename MapFn, typename ReduceFn, typename CombineFn = void>
+    struct Job {
+        using key_type = K;
+        using value_type = V;
+
+        static void map(void* ctx, const char* input, size_t input_len, mr_emit_t emit) {
+            Emitter<K, V> emitter(ctx, emit, false);
+            MapFn{}(std::string_view(input, input_len), emitter);
+        }
+
+        static void reduce(void* ctx, const char* key, size_t key_len, const mr_slice* values, size_t values_len, mr_emit_t emit) {
+            Emitter<K, V> emitter(ctx, emit, true);
+            ReduceFn{}(Serializer<K>::decode(std::string_view(key, key_len)), Values<V>(values, values_len), emitter);
+        }
+
+        static void combine(void* ctx, const char* key, size_t key_len, const mr_slice* values, size_t values_len, mr_emit_t emit)
+            requires (!std::is_void_v<CombineFn>) {
+            Emitter<K, V> emitter(ctx, emit, false);
+            CombineFn{}(Serializer<K>::decode(std::string_view(key, key_len)), Values<V>(values, values_len), emitter);
+        }
+    };
+}
+
+// Define the mr_map and mr_reduce functions of the worker's C ABI for a Job type
+#define MAPREDUCE_EXPORT_JOB(...) \
+    extern "C" void mr_map(void* ctx, const char* input, size_t input_len, mr_emit_t emit) { \
+        __VA_ARGS__::map(ctx, input, input_len, emit); \
+    } \
+    extern "C" void mr_reduce(void* ctx, const char* key, size_t key_len, const mr_slice* values, size_t values_len, mr_emit_t emit) { \
+        __VA_ARGS__::reduce(ctx, key, key_len, values, values_len, emit); \
+    }
+
+// Define mr_combine for a Job type with a CombineFn
+#define MAPREDUCE_EXPORT_COMBINER(...) \
+    extern "C" void mr_combine(void* ctx, const char* key, size_t key_len, const mr_slice* values, size_t values_len, mr_emit_t emit) { \
+        __VA_ARGS__::combine(ctx, key, key_len, values, values_len, emit); \
+    }
+
+#endif //MAPREDUCE_JOB_HPP
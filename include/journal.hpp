@@ -0,0 +1,93 @@
+//
+// Append-only journal of the task state transitions of a job.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_JOURNAL_HPP
+#define MAPREDUCE_JOURNAL_HPP
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace mapreduce {
+    // Records the state transitions of the tasks of a job, one line of space-separated fields
+    // per transition, so that a restarted coordinator can skip the tasks that already completed.
+    // Every record is flushed as it is written, a crash can at most leave the last line
+    // truncated, and read() drops a line that doesn't end with a newline.
+    class JobJournal {
+    public:
+        // Open the journal, appending to it if it already exists and append is true. A line
+        // truncated by a crash is cut off first, so that the next record starts a line of its own.
+        bool open(const std::string& filename, bool append) {
+            if (append) {
+                dropTruncatedLine(filename);
+            }
+            this->file.open(filename, append ? std::ios::app : std::ios::trunc);
+            return this->file.is_open();
+        }
+
+        bool is_open() const {
+            return this->file.is_open();
+        }
+
+        // Append a record, the fields must not contain spaces or newlines
+        void record(const std::vector<std::string>& fields) {
+            if (!this->file.is_open()) {
+                return;
+            }
+            for (size_t i = 0; i < fields.size(); i++) {
+                this->file << (i > 0 ? " " : "") << fields[i];
+            }
+            this->file << '\n';
+            this->file.flush();
+        }
+
+        // Read the complete records of a journal, empty if it doesn't exist
+        static std::vector<std::vector<std::string>> read(const std::string& filename) {
+            std::ifstream file(filename);
+            std::vector<std::vector<std::string>> records;
+            std::string line;
+            while (std::getline(file, line)) {
+                if (file.eof()) {
+                    break; // Truncated by a crash
+                }
+                std::istringstream fields(line);
+                std::vector<std::string> record;
+                for (std::string field; fields >> field; ) {
+                    record.push_back(field);
+                }
+                if (!record.empty()) {
+                    records.push_back(std::move(record));
+                }
+            }
+            return records;
+        }
+
+    private:
+        // Shrink the file to just after its last newline
+        static void dropTruncatedLine(const std::string& filename) {
+            std::error_code error;
+            const auto size = std::filesystem::file_size(filename, error);
+            if (error || size == 0) {
+                return;
+            }
+            std::ifstream in(filename, std::ios::binary);
+            std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            in.close();
+            const size_t end = contents.rfind('\n');
+            const size_t length = end == std::string::npos ? 0 : end + 1;
+            if (length < contents.size()) {
+                std::filesystem::resize_file(filename, length, error);
+            }
+        }
+
+        std::ofstream file;
+    };
+}
+
+#endif //MAPREDUCE_JOURNAL_HPP
@@ -0,0 +1,237 @@
+//
+// In-memory shuffle of the intermediate records of a job that runs in a single process.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_LOCAL_SHUFFLE_HPP
+#define MAPREDUCE_LOCAL_SHUFFLE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "arena.hpp"
+#include "intermediate.hpp"
+#include "metrics.hpp"
+
+namespace mapreduce {
+    // A run of records held in memory. Keys and values are copied into an arena, so adding a
+    // record does not allocate, and the run can be sorted and read back as a RecordSource.
+    class MemoryRun {
+    public:
+        MemoryRun() : arena(64 * 1024) { }
+
+        void add(std::string_view key, std::string_view value) {
+            size_t offset = this->arena.append(key);
+            this->arena.append(value);
+            this->entries.push_back({0, offset, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())});
+        }
+
+        // Sort the records in the given order, records with equal keys keep their order
+        void sort(KeyOrder order) {
+            for (auto& entry : this->entries) {
+                entry.prefix = orderPrefix(order, key(entry));
+            }
+            std::stable_sort(this->entries.begin(), this->entries.end(), [this](const Entry& a, const Entry& b) {
+                if (a.prefix != b.prefix) {
+                    return a.prefix < b.prefix;
+                }
+                return key(a) < key(b);
+            });
+        }
+
+        size_t size() const {
+            return this->entries.size();
+        }
+
+        // Memory used by the records
+        size_t bytes() const {
+            return this->arena.size() + this->entries.size() * sizeof(Entry);
+        }
+
+        // Write the records to an intermediate file, returns false if it could not be written
+        bool spill(const std::string& filename, const WriterOptions& options) const {
+            ScopedTimer timer(Counter::SPILL_WRITE_NS);
+            RecordWriter writer(filename, options);
+            for (const auto& entry : this->entries) {
+                writer.write(key(entry), value(entry));
+            }
+            const bool ok = writer.close();
+            Metrics::add(Counter::SPILLS, 1);
+            Metrics::add(Counter::SPILLED_RECORDS, writer.records());
+            Metrics::add(Counter::SPILLED_BYTES, writer.bytes());
+            return ok;
+        }
+
+        // Read the records in their current order. The run must outlive the source.
+        std::unique_ptr<RecordSource> source() const {
+            return std::make_unique<Source>(*this);
+        }
+
+    private:
+        struct Entry {
+            uint64_t prefix;
+            uint64_t offset;
+            uint32_t key_len;
+            uint32_t value_len;
+        };
+
+        class Source : public RecordSource {
+        public:
+            explicit Source(const MemoryRun& run) : run(run) { }
+
+            bool next() override {
+                return ++this->index < this->run.entries.size();
+            }
+
+            std::string_view key() const override {
+                return this->run.key(this->run.entries[this->index]);
+            }
+
+            std::string_view value() const override {
+                return this->run.value(this->run.entries[this->index]);
+            }
+
+        private:
+            const MemoryRun& run;
+            size_t index = SIZE_MAX; // Before the first record
+        };
+
+        std::string_view key(const Entry& entry) const {
+            return this->arena.view(entry.offset, entry.key_len);
+        }
+
+        std::string_view value(const Entry& entry) const {
+            return this->arena.view(entry.offset + entry.key_len + 1, entry.value_len);
+        }
+
+        Arena arena;
+        std::vector<Entry> entries;
+    };
+
+    // Holds the runs of every partition, in the order they were added, until they are read.
+    // The runs stay in memory while they fit in the memory limit. Past it, the largest runs are
+    // spilled to intermediate files named <spill_prefix>-<n>, which are removed once released.
+    // Runs may be added by several threads at once.
+    class LocalShuffle {
+    public:
+        LocalShuffle(size_t num_partitions, size_t memory_limit, std::string spill_prefix, WriterOptions options)
+            : memory_limit(memory_limit),
+              spill_prefix(std::move(spill_prefix)),
+              options(options),
+              partitions(num_partitions) { }
+
+        ~LocalShuffle() {
+            for (size_t p = 0; p < this->partitions.size(); p++) {
+                release(p);
+            }
+        }
+
+        LocalShuffle(const LocalShuffle&) = delete;
+        LocalShuffle& operator=(const LocalShuffle&) = delete;
+
+        // Take a run of a partition, returns false if a spill failed
+        bool add(size_t partition, std::unique_ptr<MemoryRun> run) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->memory_used += run->bytes();
+            this->partitions[partition].push_back({std::move(run), ""});
+
+            while (this->memory_used > this->memory_limit) {
+                // Spill the largest run in memory
+                size_t victim_partition = 0;
+                size_t victim_index = SIZE_MAX;
+                for (size_t p = 0; p < this->partitions.size(); p++) {
+                    const auto& runs = this->partitions[p];
+                    for (size_t i = 0; i < runs.size(); i++) {
+                        if (runs[i].memory && (victim_index == SIZE_MAX
+                                || runs[i].memory->bytes() > this->partitions[victim_partition][victim_index].memory->bytes())) {
+                            victim_partition = p;
+                            victim_index = i;
+                        }
+                    }
+                }
+                if (victim_index == SIZE_MAX) {
+                    break; // Every run is being spilled by another thread
+                }
+                // The run is written outside of the lock, so that other threads can keep adding
+                // runs meanwhile
+                std::unique_ptr<MemoryRun> spilled = std::move(this->partitions[victim_partition][victim_index].memory);
+                this->memory_used -= spilled->bytes();
+                const std::string filename = this->spill_prefix + "-" + std::to_string(this->num_spills++);
+
+                lock.unlock();
+                const bool ok = spilled->spill(filename, this->options);
+                spilled.reset();
+                lock.lock();
+                this->partitions[victim_partition][victim_index].spill = filename;
+                if (!ok) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Sources of the runs of a partition in the order they were added, whether they are in
+        // memory or spilled. The runs must not be released before the sources are done. Throws
+        // std::runtime_error if a spill can't be opened.
+        std::vector<std::unique_ptr<RecordSource>> sources(size_t partition) const {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            std::vector<std::unique_ptr<RecordSource>> sources;
+            for (const auto& run : this->partitions[partition]) {
+                if (run.memory) {
+                    sources.push_back(run.memory->source());
+                    continue;
+                }
+                auto reader = std::make_unique<RecordReader>(run.spill);
+                if (!reader->is_open()) {
+                    throw std::runtime_error("failed to open spill " + run.spill);
+                }
+                sources.push_back(std::move(reader));
+            }
+            return sources;
+        }
+
+        // Free the runs of a partition once they have been read
+        void release(size_t partition) {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (auto& run : this->partitions[partition]) {
+                if (run.memory) {
+                    this->memory_used -= run.memory->bytes();
+                } else if (!run.spill.empty()) {
+                    std::filesystem::remove(run.spill);
+                }
+            }
+            this->partitions[partition].clear();
+        }
+
+        // Number of runs spilled so far
+        size_t spills() const {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->num_spills;
+        }
+
+    private:
+        // A run is in memory, or spilled to a file. It is neither while it is being spilled.
+        struct Run {
+            std::unique_ptr<MemoryRun> memory;
+            std::string spill;
+        };
+
+        size_t memory_limit;
+        std::string spill_prefix;
+        WriterOptions options;
+
+        mutable std::mutex mutex;
+        std::vector<std::vector<Run>> partitions;
+        size_t memory_used = 0;
+        size_t num_spills = 0;
+    };
+}
+
+#endif //MAPREDUCE_LOCAL_SHUFFLE_HPP
@@ -0,0 +1,326 @@
+//
+// Bounded in-memory buffer for the output of a map task.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_MAP_OUTPUT_BUFFER_HPP
+#define MAPREDUCE_MAP_OUTPUT_BUFFER_HPP
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "arena.hpp"
+#include "intermediate.hpp"
+#include "metrics.hpp"
+#include "parallel_sort.hpp"
+
+namespace mapreduce {
+    // Collects the partitioned output of a map task in a fixed-size sort buffer. When the buffer
+    // is full, its records are sorted by (partition, key) and spilled to disk as one sorted run
+    // per partition. Once the task is done, the runs of each partition are merged into the
+    // final intermediate file <output_prefix>-<partition>, so memory use is bounded by the
+    // buffer capacity regardless of the size of the input.
+    //
+    // Keys and values are copied into an arena and records only hold their offsets, so
+    // buffering a record does not allocate. Spills sort compact (partition, key prefix, index)
+    // entries rather than the records, on the sort pool if there is one, and only compare the
+    // keys themselves when their prefixes are equal.
+    class MapOutputBuffer {
+    public:
+        // Called once per key of a sorted run with all of its values, and writes the combined
+        // records to the writer. Keys and values are NUL-terminated.
+        using Combiner = std::function<void(std::string_view key, const std::vector<std::string_view>& values, RecordWriter& writer)>;
+
+        MapOutputBuffer(std::string output_prefix, size_t num_partitions, size_t capacity, WriterOptions options,
+                        Combiner combiner = nullptr, ThreadPool* sort_pool = nullptr)
+            : output_prefix(std::move(output_prefix)),
+              num_partitions(num_partitions),
+              capacity(capacity),
+              options(options),
+              combiner(std::move(combiner)),
+              sort_pool(sort_pool),
+              runs(num_partitions),
+              partition_records(num_partitions),
+              partition_bytes(num_partitions) { }
+
+        void add(size_t partition, std::string_view key, std::string_view value) {
+            // The value is stored right after the key, both are NUL-terminated
+            size_t offset = this->arena.append(key);
+            this->arena.append(value);
+            this->records.push_back({offset, static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()), static_cast<uint32_t>(partition)});
+            this->num_added++;
+            if (this->arena.size() + this->records.size() * (sizeof(Record) + sizeof(SortEntry)) >= this->capacity && !spill()) {
+                this->failed = true;
+            }
+        }
+
+        // Spill the remaining records and merge the runs of every partition into its final
+        // intermediate file. Every partition file is created, even if it is empty, so that the
+        // reducers can always read their partition from every map task. The files are written
+        // under a temporary name and renamed, so a partition file is never seen half written.
+        // Returns false if a file could not be written.
+        bool finish() {
+            if (this->failed || (!this->records.empty() && !spill())) {
+                return false;
+            }
+
+            for (size_t p = 0; p < this->num_partitions; p++) {
+                std::string output_filename = this->output_prefix + "-" + std::to_string(p);
+                std::vector<Run> runs = std::move(this->runs[p]);
+
+                // Merge in passes so that at most merge_width runs are open at once
+                for (size_t pass = 0; runs.size() > merge_width; pass++) {
+                    std::vector<Run> batch(runs.begin(), runs.begin() + merge_width);
+                    runs.erase(runs.begin(), runs.begin() + merge_width);
+                    Run merged{output_filename + ".merge-" + std::to_string(pass), 0};
+                    if (!merge(batch, merged)) {
+                        return false;
+                    }
+                    runs.push_back(merged);
+                }
+
+                Run output{output_filename + ".tmp", 0};
+                if (runs.size() == 1) {
+                    // A single run is already sorted and combined
+                    output.filename = runs[0].filename;
+                    output.records = runs[0].records;
+                } else if (!merge(runs, output)) {
+                    return false;
+                }
+                std::error_code error;
+                std::filesystem::rename(output.filename, output_filename, error);
+                if (error) {
+                    std::cerr << "Failed to rename " << output.filename << " to " << output_filename << ": " << error.message() << std::endl;
+                    return false;
+                }
+                this->num_written += output.records;
+                this->partition_records[p] = output.records;
+                const auto size = std::filesystem::file_size(output_filename, error);
+                this->partition_bytes[p] = error ? 0 : size;
+            }
+            return true;
+        }
+
+        // Spill the buffered records without merging the runs, so that the runs can be handed
+        // to another buffer with absorb(). Returns false if a file could not be written.
+        bool flush() {
+            if (this->failed || (!this->records.empty() && !spill())) {
+                this->failed = true;
+                return false;
+            }
+            return true;
+        }
+
+        // Take over the flushed runs of another buffer with the same partitions, they are
+        // merged into the output of this buffer by finish(). Buffers filled by different
+        // threads are combined this way.
+        void absorb(MapOutputBuffer& other) {
+            for (size_t p = 0; p < this->num_partitions; p++) {
+                auto& runs = other.runs[p];
+                this->runs[p].insert(this->runs[p].end(), runs.begin(), runs.end());
+                runs.clear();
+            }
+            this->num_added += other.num_added;
+            this->num_spills += other.num_spills;
+            this->failed = this->failed || other.failed;
+        }
+
+        size_t partitions() const {
+            return this->num_partitions;
+        }
+
+        // Number of records emitted by the map task
+        size_t added() const {
+            return this->num_added;
+        }
+
+        // Number of records written to the intermediate files, after combining
+        size_t written() const {
+            return this->num_written;
+        }
+
+        // Number of records and bytes written to the intermediate file of a partition
+        size_t written(size_t partition) const {
+            return this->partition_records[partition];
+        }
+
+        uint64_t writtenBytes(size_t partition) const {
+            return this->partition_bytes[partition];
+        }
+
+        size_t spills() const {
+            return this->num_spills;
+        }
+
+    private:
+        struct Record {
+            uint64_t offset;
+            uint32_t key_len;
+            uint32_t value_len;
+            uint32_t partition;
+        };
+
+        // Sort key of a record, ties on partition and prefix are broken by comparing the keys
+        struct SortEntry {
+            uint64_t prefix;
+            uint32_t partition;
+            uint32_t index;
+        };
+
+        std::string_view key(const Record& record) const {
+            return this->arena.view(record.offset, record.key_len);
+        }
+
+        std::string_view value(const Record& record) const {
+            return this->arena.view(record.offset + record.key_len + 1, record.value_len);
+        }
+
+        // A sorted run of one partition spilled to disk
+        struct Run {
+            std::string filename;
+            size_t records;
+        };
+
+        // Merge sorted runs into the output run, combining the values of every key, and remove them
+        bool merge(const std::vector<Run>& runs, Run& output) {
+            ScopedTimer timer(Counter::MAP_MERGE_NS);
+            RecordWriter writer(output.filename, this->options);
+            if (!writer.is_open()) {
+                std::cerr << "Failed to open output file: " << output.filename << std::endl;
+                return false;
+            }
+
+            std::vector<std::unique_ptr<RecordSource>> sources;
+            for (const auto& run : runs) {
+                auto reader = std::make_unique<RecordReader>(run.filename);
+                if (!reader->is_open()) {
+                    std::cerr << "Failed to open spill file: " << run.filename << std::endl;
+                    return false;
+                }
+                sources.push_back(std::move(reader));
+            }
+            MergeIterator merged(std::move(sources), this->options.key_order);
+            if (this->combiner) {
+                groupByKey(merged, [&](std::string_view key, const std::vector<std::string_view>& values) {
+                    this->combiner(key, values, writer);
+                });
+            } else {
+                while (merged.next()) {
+                    writer.write(merged.key(), merged.value());
+                }
+            }
+            if (!writer.close()) {
+                std::cerr << "Failed to write output file: " << output.filename << std::endl;
+                return false;
+            }
+            output.records = writer.records();
+
+            for (const auto& run : runs) {
+                std::error_code error;
+                std::filesystem::remove(run.filename, error);
+            }
+            return true;
+        }
+
+        // Sort the buffered records and write one sorted run per non-empty partition
+        bool spill() {
+            const auto sort_start = std::chrono::steady_clock::now();
+            this->order.clear();
+            this->order.reserve(this->records.size());
+            for (size_t i = 0; i < this->records.size(); i++) {
+                const Record& record = this->records[i];
+                this->order.push_back({orderPrefix(this->options.key_order, key(record)), record.partition, static_cast<uint32_t>(i)});
+            }
+            parallelSort(this->sort_pool, this->order, [this](const SortEntry& a, const SortEntry& b) {
+                if (a.partition != b.partition) {
+                    return a.partition < b.partition;
+                }
+                if (a.prefix != b.prefix) {
+                    return a.prefix < b.prefix;
+                }
+                return key(this->records[a.index]) < key(this->records[b.index]);
+            });
+            Metrics::add(Counter::SPILL_SORT_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - sort_start).count());
+
+            ScopedTimer timer(Counter::SPILL_WRITE_NS);
+            std::vector<std::string_view> values;
+            size_t i = 0;
+            while (i < this->order.size()) {
+                const size_t partition = this->order[i].partition;
+                std::string run_filename = this->output_prefix + "-" + std::to_string(partition)
+                    + ".spill-" + std::to_string(this->num_spills);
+                RecordWriter writer(run_filename, this->options);
+                if (!writer.is_open()) {
+                    std::cerr << "Failed to open spill file: " << run_filename << std::endl;
+                    return false;
+                }
+
+                for (; i < this->order.size() && this->order[i].partition == partition; ) {
+                    const Record& record = this->records[this->order[i].index];
+                    if (!this->combiner) {
+                        writer.write(key(record), value(record));
+                        i++;
+                        continue;
+                    }
+
+                    // Combine all the values of the key
+                    std::string_view group_key = key(record);
+                    values.clear();
+                    size_t j = i;
+                    for (; j < this->order.size() && this->order[j].partition == partition; j++) {
+                        const Record& other = this->records[this->order[j].index];
+                        if (this->order[j].prefix != this->order[i].prefix || key(other) != group_key) {
+                            break;
+                        }
+                        values.push_back(value(other));
+                    }
+                    this->combiner(group_key, values, writer);
+                    i = j;
+                }
+
+                if (!writer.close()) {
+                    std::cerr << "Failed to write spill file: " << run_filename << std::endl;
+                    return false;
+                }
+                this->runs[partition].push_back({run_filename, writer.records()});
+                Metrics::add(Counter::SPILLED_RECORDS, writer.records());
+                Metrics::add(Counter::SPILLED_BYTES, writer.bytes());
+            }
+
+            Metrics::add(Counter::SPILLS, 1);
+            this->num_spills++;
+            this->records.clear();
+            this->order.clear();
+            this->arena.reset();
+            return true;
+        }
+
+        std::string output_prefix;
+        size_t num_partitions;
+        size_t capacity;
+        WriterOptions options;
+        Combiner combiner;
+        ThreadPool* sort_pool;
+        static constexpr size_t merge_width = 64;
+
+        Arena arena;
+        std::vector<Record> records;
+        std::vector<SortEntry> order; // Sorted order of the records, kept to reuse its memory
+        size_t num_spills = 0;
+        size_t num_added = 0;
+        size_t num_written = 0;
+        bool failed = false;
+        std::vector<std::vector<Run>> runs; // Sorted runs of each partition
+        std::vector<size_t> partition_records; // Written by finish()
+        std::vector<uint64_t> partition_bytes;
+    };
+}
+
+#endif //MAPREDUCE_MAP_OUTPUT_BUFFER_HPP
@@ -0,0 +1,198 @@
+//
+// Persistent cache of the partitioned outputs of map tasks, keyed by the fingerprint of their input.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_MAP_OUTPUT_CACHE_HPP
+#define MAPREDUCE_MAP_OUTPUT_CACHE_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+#include "input_split.hpp"
+#include "mapped_file.hpp"
+
+namespace mapreduce {
+    // Incremental 64-bit FNV-1a hash, the same function as hashKey()
+    class Fingerprint {
+    public:
+        Fingerprint& add(std::string_view bytes) {
+            for (unsigned char c : bytes) {
+                this->hash ^= c;
+                this->hash *= 1099511628211ULL;
+            }
+            return *this;
+        }
+
+        // Fields are length-prefixed, so that ("ab", "c") and ("a", "bc") differ
+        Fingerprint& field(std::string_view bytes) {
+            add(std::to_string(bytes.size()));
+            add(":");
+            return add(bytes);
+        }
+
+        Fingerprint& field(uint64_t value) {
+            return field(std::to_string(value));
+        }
+
+        uint64_t value() const {
+            return this->hash;
+        }
+
+        std::string hex() const {
+            static constexpr char digits[] = "0123456789abcdef";
+            std::string hex(16, '0');
+            for (size_t i = 0; i < 16; i++) {
+                hex[i] = digits[(this->hash >> (60 - 4 * i)) & 0xf];
+            }
+            return hex;
+        }
+
+    private:
+        uint64_t hash = 14695981039346656037ULL;
+    };
+
+    // Hash of the contents of a file, 0 if it can't be read
+    inline uint64_t hashFile(const std::string& filename) {
+        MappedFile file(filename);
+        if (!file.is_open()) {
+            return 0;
+        }
+        return Fingerprint().add(file.data()).value();
+    }
+
+    // Keeps the intermediate files of map tasks across runs of a job, so that a rerun only maps
+    // the splits whose input changed. The output of a split is stored in the directory
+    // <dir>/<fingerprint>, as the files <prefix>-<partition> with the prefix returned by
+    // lookup(). The fingerprint covers the split, the size and modification time of its file
+    // (or its contents), and the job: everything else that determines the map output, such as
+    // the hash of the map function's shared object and the partitioning, is passed as the
+    // job fingerprint.
+    //
+    // Entries are written to a temporary directory and renamed into place, so an entry is
+    // either complete or absent. prune() removes the entries this run didn't use or store, so
+    // the cache only holds the map outputs of the latest run, and every job needs a cache
+    // directory of its own.
+    class MapOutputCache {
+    public:
+        MapOutputCache(std::string dir, uint64_t job_fingerprint, size_t num_partitions, bool hash_contents)
+            : dir(std::move(dir)), job_fingerprint(job_fingerprint), num_partitions(num_partitions), hash_contents(hash_contents) { }
+
+        // Create the cache directory if it doesn't exist, returns false if it can't be
+        bool open() {
+            std::error_code error;
+            std::filesystem::create_directories(this->dir, error);
+            return std::filesystem::is_directory(this->dir, error);
+        }
+
+        // Fingerprint of the map output of a split, empty if its file can't be read
+        std::string fingerprint(const InputSplit& split) {
+            std::error_code error;
+            const auto path = std::filesystem::absolute(split.filename, error).lexically_normal();
+            const auto size = std::filesystem::file_size(split.filename, error);
+            if (error) {
+                return "";
+            }
+            Fingerprint fingerprint;
+            fingerprint.field(this->job_fingerprint).field(path.string()).field(split.offset).field(split.length).field(size);
+            if (this->hash_contents) {
+                // Every split of a file hashes the same contents, so they are only read once
+                auto it = this->file_hashes.find(split.filename);
+                if (it == this->file_hashes.end()) {
+                    it = this->file_hashes.emplace(split.filename, hashFile(split.filename)).first;
+                }
+                fingerprint.field(it->second);
+            } else {
+                const auto mtime = std::filesystem::last_write_time(split.filename, error);
+                if (error) {
+                    return "";
+                }
+                fingerprint.field(static_cast<uint64_t>(mtime.time_since_epoch().count()));
+            }
+            return fingerprint.hex();
+        }
+
+        // Prefix of the cached intermediate files of a fingerprint, empty if they are not cached
+        std::string lookup(const std::string& fingerprint) {
+            if (fingerprint.empty()) {
+                return "";
+            }
+            const std::string prefix = (std::filesystem::path(this->dir) / fingerprint / "map").string();
+            std::error_code error;
+            for (size_t p = 0; p < this->num_partitions; p++) {
+                if (!std::filesystem::is_regular_file(prefix + "-" + std::to_string(p), error)) {
+                    return "";
+                }
+            }
+            this->live.insert(fingerprint);
+            return prefix;
+        }
+
+        // Add the intermediate files <prefix>-<partition> of a map task to the cache. They are
+        // hard linked if possible, and copied otherwise. Returns false if they could not be.
+        bool store(const std::string& fingerprint, const std::string& prefix) {
+            if (fingerprint.empty()) {
+                return false;
+            }
+            const auto entry = std::filesystem::path(this->dir) / fingerprint;
+            const auto temp = std::filesystem::path(this->dir) / (fingerprint + ".tmp-" + std::to_string(getpid()));
+            std::error_code error;
+            std::filesystem::remove_all(temp, error);
+            std::filesystem::create_directory(temp, error);
+            for (size_t p = 0; p < this->num_partitions && !error; p++) {
+                const std::string source = prefix + "-" + std::to_string(p);
+                const auto target = temp / ("map-" + std::to_string(p));
+                std::filesystem::create_hard_link(source, target, error);
+                if (error) {
+                    error.clear();
+                    std::filesystem::copy_file(source, target, error);
+                }
+            }
+            if (!error) {
+                // An entry stored by an earlier run for the same fingerprint has the same contents
+                std::filesystem::remove_all(entry, error);
+                std::filesystem::rename(temp, entry, error);
+            }
+            if (error) {
+                std::filesystem::remove_all(temp, error);
+                return false;
+            }
+            this->live.insert(fingerprint);
+            return true;
+        }
+
+        // Remove the entries that were neither looked up nor stored since the cache was
+        // created, returns the number of entries removed
+        size_t prune() {
+            size_t removed = 0;
+            std::error_code error;
+            for (const auto& entry : std::filesystem::directory_iterator(this->dir, error)) {
+                const std::string name = entry.path().filename().string();
+                // Only directories the cache wrote, including the leftovers of interrupted stores
+                if (name.size() < 16 || name.find_first_not_of("0123456789abcdef") < 16 || this->live.contains(name)) {
+                    continue;
+                }
+                std::error_code remove_error;
+                std::filesystem::remove_all(entry.path(), remove_error);
+                removed += !remove_error;
+            }
+            return removed;
+        }
+
+    private:
+        std::string dir;
+        uint64_t job_fingerprint;
+        size_t num_partitions;
+        bool hash_contents;
+        std::unordered_map<std::string, uint64_t> file_hashes;
+        std::unordered_set<std::string> live; // Fingerprints used by this run
+    };
+}
+
+#endif //MAPREDUCE_MAP_OUTPUT_CACHE_HPP
@@ -0,0 +1,72 @@
+//
+// Read-only memory mapping of an input file.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_MAPPED_FILE_HPP
+#define MAPREDUCE_MAPPED_FILE_HPP
+
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mapreduce {
+    // Maps a whole file read-only, so map tasks can scan the page cache directly instead of
+    // copying the file into memory. The mapping is advised as sequential, which lets the
+    // kernel read ahead aggressively and drop pages behind the scan.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                this->opened = true;
+                this->length = st.st_size;
+                // mmap() fails for empty files, which are simply mapped as an empty view
+                if (this->length > 0) {
+                    void* addr = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (addr == MAP_FAILED) {
+                        this->opened = false;
+                        this->length = 0;
+                    } else {
+                        this->addr = static_cast<const char*>(addr);
+                        madvise(addr, this->length, MADV_SEQUENTIAL);
+                    }
+                }
+            }
+            close(fd);
+        }
+
+        ~MappedFile() {
+            if (this->addr) {
+                munmap(const_cast<char*>(this->addr), this->length);
+            }
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool is_open() const {
+            return this->opened;
+        }
+
+        // The contents of the file. They are not NUL-terminated.
+        std::string_view data() const {
+            return std::string_view(this->addr, this->length);
+        }
+
+    private:
+        const char* addr = nullptr;
+        size_t length = 0;
+        bool opened = false;
+    };
+}
+
+#endif //MAPREDUCE_MAPPED_FILE_HPP
@@ -13,13 +13,32 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <filesystem>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
 #include <grpcpp/grpcpp.h>
 #include "coordinator.grpc.pb.h"
+#include "compression.hpp"
+#include "final_output.hpp"
+#include "input_split.hpp"
+#include "job.hpp"
+#include "journal.hpp"
+#include "local_shuffle.hpp"
+#include "map_output_cache.hpp"
+#include "mapped_file.hpp"
+#include "metrics.hpp"
+#include "partition.hpp"
+#include "skew.hpp"
+#include "thread_pool.hpp"
 
 using grpc::Server;
 using grpc::Status;
@@ -30,6 +49,12 @@ using coordinator::AssignRequest;
 using coordinator::AssignReply;
 using coordinator::CompleteRequest;
 using coordinator::CompleteReply;
+using coordinator::MapOutputsRequest;
+using coordinator::MapOutputsReply;
+using coordinator::HeartbeatRequest;
+using coordinator::HeartbeatReply;
+using mapreduce::Metrics;
+using mapreduce::Histogram;
 
 enum TaskType {
     MAP,
@@ -42,25 +67,82 @@ enum TaskState {
     COMPLETE
 };
 
+using Clock = std::chrono::steady_clock;
+
+// One execution of a task by a worker. A task normally has a single attempt, backup attempts
+// are started for stragglers, and the first attempt to complete wins.
+struct Attempt {
+    uint32_t id;
+    std::string worker_id;
+    std::string output_filename;
+    Clock::time_point start_time;
+    Clock::time_point last_heartbeat; // The attempt is abandoned if it expires
+};
+
 struct Task {
     TaskState state;
-    std::string worker_id; // For non-idle tasks
+    size_t id;
     std::string output_filename;
+    std::vector<Attempt> attempts; // Running attempts, for in progress tasks
+    uint32_t num_attempts = 0; // Number of attempts started, used for the attempt ids
+    uint32_t num_failures = 0; // Number of attempts that failed on their worker
+    Clock::time_point start_time; // Start of the first running attempt
+    Clock::time_point idle_since; // When an idle task started waiting to be assigned
+
+    Attempt* findAttempt(const std::string& worker_id, uint32_t attempt_id) {
+        for (auto& attempt : this->attempts) {
+            if (attempt.id == attempt_id && attempt.worker_id == worker_id) {
+                return &attempt;
+            }
+        }
+        return nullptr;
+    }
 };
 
+// The output_filename of a map task is the prefix of its intermediate files,
+// partition r is written to <output_filename>-<r>. Every attempt writes its own
+// files, and output_filename is set to those of the attempt that completed.
 struct MapTask : public Task {
-    std::string input_filename;
+    mapreduce::InputSplit split;
+    // Shuffle service of the worker that completed the task, which serves its intermediate
+    // files. Empty if they are read from the shared filesystem.
+    std::string shuffle_address;
+    bool sized = false; // The size of its output was added to the job's partition sizes
+    // Fingerprint of its input in the map output cache, and whether its output came from it
+    std::string fingerprint;
+    bool cached = false;
 };
 
+std::string intermediateFilename(const MapTask& task, size_t partition) {
+    return task.output_filename + "-" + std::to_string(partition);
+}
+
+// Reduce task r reads partition r of every map task, see MapOutputs. Every attempt writes
+// to a temporary file and renames it to output_filename once it is done.
+//
+// A partition that holds far more of the map output than the others is split: partial tasks,
+// added after the num_reducers reduce tasks, each run the combine function on the partition
+// of a share of the map tasks, and reduce task r then reduces the outputs of its partial tasks.
 struct ReduceTask : public Task {
-    std::vector<std::string> input_filenames;
+    size_t partition;
+    bool partial = false;
+    // Of a partial task: its share is the map tasks whose id is split modulo num_splits, and
+    // the shuffle service of the worker that completed it, as for a MapTask
+    size_t split = 0;
+    size_t num_splits = 1;
+    std::string shuffle_address;
+    // Of the reduce task of a split partition: its partial tasks, and their ids in the order
+    // they completed, once per completion like completed_map_tasks
+    std::vector<size_t> partial_tasks;
+    std::vector<size_t> completed_partials;
 };
 
 void printMapTask(const MapTask& task) {
     std::cout << "MapTask: " << std::endl;
     std::cout << "  state: " << task.state << std::endl;
-    std::cout << "  worker_id: " << task.worker_id << std::endl;
-    std::cout << "  input_filename: " << task.input_filename << std::endl;
+    std::cout << "  attempts: " << task.attempts.size() << std::endl;
+    std::cout << "  input split: " << task.split.filename << " [" << task.split.offset << ", "
+              << task.split.offset + task.split.length << ")" << std::endl;
     std::cout << "  output_filename: " << task.output_filename << std::endl;
 }
 
@@ -68,17 +150,97 @@ struct JobState {
     size_t num_mappers;
     size_t num_reducers;
     size_t segment_size;
+    size_t sort_buffer_size;
+    bool intermediate_checksums;
+    bool sorted_output;
+    bool shuffle_compression;
+    mapreduce::Compression compression;
+    std::vector<std::string> partition_boundaries;
     size_t num_segments;
-    size_t num_idle_map_tasks;
-    size_t num_idle_reduce_tasks;
+    double reduce_slowstart;
+    size_t merge_factor;
     size_t num_in_progress_map_tasks = 0;
     size_t num_in_progress_reduce_tasks = 0;
     size_t num_completed_map_tasks = 0;
     size_t num_completed_reduce_tasks = 0;
-    bool finished = false;
+    std::atomic<bool> finished = false;
+    bool failed = false; // The job finished because a task failed too often, it has no output
+    // Log every request and the tasks of the job
+    bool verbose = false;
 
+    // An attempt that doesn't send a heartbeat for this long is abandoned, and its task is
+    // assigned again if no other attempt is running
+    std::chrono::milliseconds task_lease;
+    // A task whose attempts failed this many times fails the job, instead of running again
+    size_t max_task_failures = 4;
+    // Once a phase has no idle tasks left, a task that has run speculation_slowness times
+    // longer than the average completed task of its phase gets a backup attempt
+    bool speculative_execution;
+    double speculation_slowness;
+    // Total time taken by the completed tasks of each phase
+    Clock::duration map_task_time{0};
+    Clock::duration reduce_task_time{0};
+    // When the job started, its last map task completed, and its last reduce task completed
+    Clock::time_point start_time;
+    Clock::time_point maps_completed_time;
+    Clock::time_point finished_time;
+    // Sum of the metrics reported by the workers, the coordinator's own are in Metrics
+    mapreduce::MetricValues worker_metrics;
+
+    // A partition with more than skew_threshold times the average size is split across up to
+    // max_partition_splits partial tasks, see ReduceTask. It is decided from the map tasks
+    // completed when the first reduce task is assigned, and only if the job has a combine
+    // function to merge the partial results. A threshold of 0 disables it.
+    double skew_threshold;
+    size_t max_partition_splits;
+    bool partitions_planned = false;
+    bool has_combine = true; // False if a worker reported that it has no combine function
+    // Size of every partition in the outputs of the completed map tasks, and the keys most
+    // frequently emitted by them
+    std::vector<uint64_t> partition_records;
+    std::vector<uint64_t> partition_bytes;
+    mapreduce::HeavyHitters heavy_hitters{256};
+
+    // Tasks are indexed by their id
     std::vector<MapTask> map_tasks;
     std::vector<ReduceTask> reduce_tasks;
+
+    // Ids of the map tasks in the order they completed, reduce tasks fetch their outputs in this
+    // order. A map task whose output was lost and that ran again appears once per completion.
+    std::vector<size_t> completed_map_tasks;
+
+    // Number of workers whose Assign request is being held, waiting for a task
+    size_t num_waiting_workers = 0;
+
+    // Workers that asked for a task, with the last time any request of theirs was received, and
+    // those that were told that the job has finished
+    std::unordered_map<std::string, Clock::time_point> workers;
+    std::unordered_set<std::string> finished_workers;
+
+    // Ids of the idle tasks, in the order they will be assigned. Idle map tasks are also
+    // queued by input file, so that a worker can be given a split of a file it has already
+    // read. As a map task is in two queues, the map queues are cleaned up lazily: the ids of
+    // tasks that are no longer idle are dropped when they reach the front.
+    std::deque<size_t> idle_map_tasks;
+    std::unordered_map<std::string, std::deque<size_t>> idle_map_tasks_by_file;
+    size_t num_idle_map_tasks = 0;
+    std::deque<size_t> idle_reduce_tasks;
+
+    // Input files read by the workers of each host, their pages are likely cached by the host
+    std::unordered_map<std::string, std::unordered_set<std::string>> host_inputs;
+
+    // Completed and lost tasks are recorded, so that a restarted coordinator can resume the job
+    mapreduce::JobJournal journal;
+
+    // gRPC runs the handlers on several threads, so everything above is guarded by this mutex
+    std::mutex mutex;
+    // Notified whenever a task completes or the job finishes, the long-polling handlers and the
+    // job monitor wait on it
+    std::condition_variable changed;
+    // How long Assign and MapOutputs hold a request before returning empty-handed
+    std::chrono::milliseconds long_poll_timeout = std::chrono::seconds(10);
+    // How often the job monitor looks for expired attempts and stragglers
+    std::chrono::milliseconds monitor_interval = std::chrono::seconds(1);
 };
 
 class MapReduceServiceImpl final : public Coordinator::Service {
@@ -87,74 +249,35 @@ public:
     
     Status Assign(ServerContext* context, const AssignRequest* request, AssignReply* reply) override {
         // TODO: Add more error handling and validation
-        std::cout << "Received AssignRequest from worker: " << request->worker_id() << std::endl;
-        std::cout << "Number of idle map tasks: " << this->state->num_idle_map_tasks << std::endl;
-        std::cout << "Number of idle reduce tasks: " << this->state->num_idle_reduce_tasks << std::endl;
-        std::cout << "Number of in progress map tasks: " << this->state->num_in_progress_map_tasks << std::endl;
-        std::cout << "Number of in progress reduce tasks: " << this->state->num_in_progress_reduce_tasks << std::endl;
-        std::cout << "Number of completed map tasks: " << this->state->num_completed_map_tasks << std::endl;
-        std::cout << "Number of completed reduce tasks: " << this->state->num_completed_reduce_tasks << std::endl;
-
         if (request->worker_id().empty()) {
             std::cerr << "error: worker ID is empty" << std::endl;
             return Status::CANCELLED;
         }
-        
-        const bool map_phase = this->state->num_completed_map_tasks < this->state->map_tasks.size();
-
-        // Since a worker is sending an Assign RPC, we can assume that it is idle.
-        // In this simple implementation, we only assign reduce tasks once all of the reduce
-        // tasks have completed.
-        if (map_phase && this->state->num_idle_map_tasks > 0) {
-            // Search for an idle map task
-            std::cout << "TASKS:" << std::endl;
-            for (auto& task : this->state->map_tasks) {
-                printMapTask(task);
-                if (task.state == TaskState::IDLE) {
-                    reply->set_taskname("map");
-                    reply->add_input_filename(task.input_filename);
-                    reply->set_output_filename(task.output_filename);
-
-                    task.state = TaskState::IN_PROGRESS;
-                    task.worker_id = request->worker_id();
-                    this->state->num_idle_map_tasks--;
-                    this->state->num_in_progress_map_tasks++;
-                    
-                    std::cout << "Assigned map task to worker: " << request->worker_id() << std::endl;
-                    printMapTask(task);
-                    return Status::OK;
-                }
-            }
-
-
-        } else if (!map_phase && this->state->num_idle_reduce_tasks > 0) {
-            // Search for an idle reduce task to assign
-            ReduceTask idle_reduce_task;
-            for (auto& task: this->state->reduce_tasks) {
-                if (task.state == TaskState::IDLE) {
-                    reply->set_taskname("reduce");
-                    for (const auto& input_filename : task.input_filenames) {
-                        reply->add_input_filename(input_filename);
-                    }
-                    reply->set_output_filename(task.output_filename);
 
-                    task.state = TaskState::IN_PROGRESS;
-                    task.worker_id = request->worker_id();
-                    this->state->num_idle_reduce_tasks--;
+        std::unique_lock<std::mutex> lock(this->state->mutex);
 
-                    std::cout << "Assigned reduce task to worker: " << request->worker_id() << std::endl;
-                    return Status::OK;
-                }
+        // Long poll: rather than having idle workers retry, hold the request until a task can
+        // be assigned, the job finishes, or the timeout expires
+        const auto deadline = std::chrono::steady_clock::now() + this->state->long_poll_timeout;
+        markAlive(request->worker_id());
+        for (;;) {
+            if (this->state->finished) {
+                reply->set_taskname("done");
+                this->state->finished_workers.insert(request->worker_id());
+                this->state->changed.notify_all();
+                return Status::OK;
+            }
+            if (assignTask(request, reply)) {
+                return Status::OK;
+            }
+            this->state->num_waiting_workers++;
+            const bool timeout = this->state->changed.wait_until(lock, deadline) == std::cv_status::timeout;
+            this->state->num_waiting_workers--;
+            if (timeout) {
+                reply->set_taskname("wait");
+                return Status::OK;
             }
-            
-        } else {
-            // There are no idle tasks, so we can't assign any more to the worker
-            // In this case, the worker should wait, and then send another Assign RPC
-            std::cout << "No more tasks to assign to worker: " << request->worker_id() << std::endl;
-            return Status::CANCELLED;
         }
-
-        return Status::OK;
     }
     
     Status Complete(ServerContext* context, const CompleteRequest* request, CompleteReply* reply) override {
@@ -164,51 +287,687 @@ public:
             return Status::CANCELLED;
         }
 
-        std::cout << "Received CompleteRequest from worker: " << request->worker_id() << std::endl;
+        std::lock_guard<std::mutex> lock(this->state->mutex);
+        markAlive(request->worker_id());
+
+        if (this->state->verbose) {
+            std::cout << "Received CompleteRequest for " << request->taskname() << " task " << request->task_id()
+                      << " attempt " << request->attempt_id() << " from worker: " << request->worker_id() << std::endl;
+        }
+        // The metrics cover all the work of the worker since its previous request, whether or not
+        // this attempt is accepted
+        addWorkerMetrics(*request);
         
         if (request->taskname() == "map") {
-            // Update the reduce task to be complete
-            for (auto& task : this->state->map_tasks) {
-                if (task.worker_id == request->worker_id()) {
-                    task.state = TaskState::COMPLETE;
-                    this->state->num_completed_map_tasks++;
-                    this->state->num_in_progress_map_tasks--;
-                    std::cout << "Map task completed by worker: " << request->worker_id() << std::endl;
-                    return Status::OK;
+            if (request->task_id() >= this->state->map_tasks.size()) {
+                std::cerr << "error: unknown map task " << request->task_id() << std::endl;
+                return Status(grpc::StatusCode::INVALID_ARGUMENT, "unknown map task");
+            }
+
+            MapTask& task = this->state->map_tasks[request->task_id()];
+            Attempt* attempt = task.findAttempt(request->worker_id(), request->attempt_id());
+            if (task.state == TaskState::COMPLETE) {
+                // Another attempt completed first, the worker discards this one
+                std::cout << "Map task " << task.id << " was already completed by another attempt" << std::endl;
+                reply->set_accepted(false);
+                return Status::OK;
+            }
+            if (!attempt) {
+                std::cerr << "error: map task " << task.id << " attempt " << request->attempt_id()
+                          << " is not running on worker: " << request->worker_id() << std::endl;
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "map task attempt is not running on this worker");
+            }
+            if (request->failed()) {
+                if (failAttempt(task, *attempt, this->state->num_in_progress_map_tasks, "map")) {
+                    queueIdleMapTask(task);
+                }
+                reply->set_accepted(false);
+                reply->set_job_finished(this->state->finished);
+                if (this->state->finished) {
+                    this->state->finished_workers.insert(request->worker_id());
                 }
+                return Status::OK;
+            }
+
+            // The first attempt to complete wins, the intermediate files of this attempt are
+            // the ones sent to the reduce tasks
+            task.output_filename = attempt->output_filename;
+            task.shuffle_address = request->shuffle_address();
+            addPartitionSizes(task, *request);
+            this->state->map_task_time += Clock::now() - attempt->start_time;
+            Metrics::record(Histogram::MAP_TASK_US, mapreduce::elapsedUs(attempt->start_time));
+            completeTask(task);
+            this->state->num_completed_map_tasks++;
+            this->state->num_in_progress_map_tasks--;
+            this->state->completed_map_tasks.push_back(task.id);
+            if (this->state->num_completed_map_tasks == this->state->map_tasks.size()) {
+                this->state->maps_completed_time = Clock::now();
             }
+            this->state->journal.record({"complete", "map", std::to_string(task.id), task.output_filename, task.shuffle_address});
+            std::cout << "Map task " << task.id << " completed by worker: " << request->worker_id() << std::endl;
+
+            // Reduce tasks may now be ready, and running reduce tasks wait for this output
+            this->state->changed.notify_all();
+            reply->set_accepted(true);
+            return Status::OK;
         } else if (request->taskname() == "reduce") {
-            // Update the reduce task to be complete
-            for (auto& task : this->state->reduce_tasks) {
-                if (task.worker_id == request->worker_id()) {
-                    task.state = TaskState::COMPLETE;
-                    this->state->num_completed_reduce_tasks++;
-                    this->state->num_in_progress_reduce_tasks--;
-                    std::cout << "Reduce task completed by worker: " << request->worker_id() << std::endl;
+            if (request->task_id() >= this->state->reduce_tasks.size()) {
+                std::cerr << "error: unknown reduce task " << request->task_id() << std::endl;
+                return Status(grpc::StatusCode::INVALID_ARGUMENT, "unknown reduce task");
+            }
+
+            ReduceTask& task = this->state->reduce_tasks[request->task_id()];
+            Attempt* attempt = task.findAttempt(request->worker_id(), request->attempt_id());
+            if (task.state == TaskState::COMPLETE) {
+                std::cout << "Reduce task " << task.id << " was already completed by another attempt" << std::endl;
+                reply->set_accepted(false);
+                reply->set_job_finished(this->state->finished);
+                return Status::OK;
+            }
+            if (!attempt) {
+                std::cerr << "error: reduce task " << task.id << " attempt " << request->attempt_id()
+                          << " is not running on worker: " << request->worker_id() << std::endl;
+                return Status(grpc::StatusCode::FAILED_PRECONDITION, "reduce task attempt is not running on this worker");
+            }
+            if (request->failed()) {
+                if (failAttempt(task, *attempt, this->state->num_in_progress_reduce_tasks, "reduce")) {
+                    task.idle_since = Clock::now();
+                    this->state->idle_reduce_tasks.push_front(task.id);
+                }
+                reply->set_accepted(false);
+                reply->set_job_finished(this->state->finished);
+                if (this->state->finished) {
+                    this->state->finished_workers.insert(request->worker_id());
                 }
+                return Status::OK;
             }
 
-            std::cout << "Number of completed reduce tasks: " << this->state->num_completed_reduce_tasks << std::endl;
-            std::cout << "Number of reduce tasks: " << this->state->reduce_tasks.size() << std::endl;
+            this->state->reduce_task_time += Clock::now() - attempt->start_time;
+            Metrics::record(Histogram::REDUCE_TASK_US, mapreduce::elapsedUs(attempt->start_time));
+            completeTask(task);
+            this->state->num_completed_reduce_tasks++;
+            this->state->num_in_progress_reduce_tasks--;
+            this->state->journal.record({"complete", "reduce", std::to_string(task.id)});
+            std::cout << "Reduce task " << task.id << " completed by worker: " << request->worker_id() << std::endl;
+            if (task.partial) {
+                // The reduce task of the partition waits for this output
+                task.shuffle_address = request->shuffle_address();
+                this->state->reduce_tasks[task.partition].completed_partials.push_back(task.id);
+                this->state->changed.notify_all();
+            }
 
             if (this->state->num_completed_reduce_tasks == this->state->reduce_tasks.size()) {
                 std::cout << "All reduce tasks have completed" << std::endl;
                 std::cout << "MapReduce job has completed" << std::endl;
 
                 this->state->finished = true;
-
+                this->state->finished_time = Clock::now();
+                this->state->changed.notify_all();
+            }
+            reply->set_accepted(true);
+            reply->set_job_finished(this->state->finished);
+            if (this->state->finished) {
+                this->state->finished_workers.insert(request->worker_id());
             }
             
             return Status::OK;
+        }
+
+        std::cerr << "error: unknown task name" << std::endl;
+        return Status::CANCELLED;
+    }
+
+    Status MapOutputs(ServerContext* context, const MapOutputsRequest* request, MapOutputsReply* reply) override {
+        std::unique_lock<std::mutex> lock(this->state->mutex);
+
+        if (request->task_id() >= this->state->reduce_tasks.size()) {
+            std::cerr << "error: unknown reduce task " << request->task_id() << std::endl;
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "unknown reduce task");
+        }
+        ReduceTask& task = this->state->reduce_tasks[request->task_id()];
+        markAlive(request->worker_id());
+        if (!renewLease(task, request->worker_id(), request->attempt_id())) {
+            reply->set_cancelled(true);
+            return Status::OK;
+        }
+        for (const auto& lost : request->lost_map_output()) {
+            if (task.partial_tasks.empty()) {
+                reexecuteMapTask(lost, request->worker_id());
+            } else {
+                reexecutePartialTask(task, lost, request->worker_id());
+            }
+        }
+
+        // Long poll until there are outputs the reduce task hasn't fetched yet
+        this->state->changed.wait_for(lock, this->state->long_poll_timeout, [&] {
+            return numOutputs(task) > request->start() || outputsComplete(task)
+                || !task.findAttempt(request->worker_id(), request->attempt_id());
+        });
+
+        // The attempt may have been cancelled while the request was held
+        if (!renewLease(task, request->worker_id(), request->attempt_id())) {
+            reply->set_cancelled(true);
+            return Status::OK;
+        }
+        if (task.partial_tasks.empty()) {
+            const auto& completed = this->state->completed_map_tasks;
+            for (size_t i = request->start(); i < completed.size(); i++) {
+                const MapTask& map_task = this->state->map_tasks[completed[i]];
+                if (task.partial && map_task.id % task.num_splits != task.split) {
+                    continue;
+                }
+                reply->add_input_filename(intermediateFilename(map_task, task.partition));
+                reply->add_shuffle_address(map_task.shuffle_address);
+                reply->add_map_task_id(map_task.id);
+            }
         } else {
-            std::cerr << "error: unknown task name" << std::endl;
-            return Status::CANCELLED;
+            for (size_t i = request->start(); i < task.completed_partials.size(); i++) {
+                const ReduceTask& partial = this->state->reduce_tasks[task.completed_partials[i]];
+                reply->add_input_filename(partial.output_filename);
+                reply->add_shuffle_address(partial.shuffle_address);
+                reply->add_map_task_id(partial.id);
+            }
         }
-        
+        reply->set_next_start(numOutputs(task));
+        reply->set_complete(outputsComplete(task));
         return Status::OK;
     }
 
+    Status Heartbeat(ServerContext* context, const HeartbeatRequest* request, HeartbeatReply* reply) override {
+        std::lock_guard<std::mutex> lock(this->state->mutex);
+        markAlive(request->worker_id());
+
+        Task* task = nullptr;
+        if (request->taskname() == "map" && request->task_id() < this->state->map_tasks.size()) {
+            task = &this->state->map_tasks[request->task_id()];
+        } else if (request->taskname() == "reduce" && request->task_id() < this->state->reduce_tasks.size()) {
+            task = &this->state->reduce_tasks[request->task_id()];
+        } else {
+            return Status(grpc::StatusCode::INVALID_ARGUMENT, "unknown task");
+        }
+
+        // Attempts that lost to another attempt or whose lease expired are told to stop
+        reply->set_cancel(!renewLease(*task, request->worker_id(), request->attempt_id()));
+        return Status::OK;
+    }
+
+    // Abandon the attempts whose lease expired, and put their tasks back in the idle queues if
+    // no other attempt is running. Called periodically by the job monitor, with the lock held.
+    void expireAttempts() {
+        const auto now = Clock::now();
+        // Returns true if the task has no attempt left, and so is idle again
+        auto expire = [&](Task& task, size_t& num_in_progress, const char* taskname) {
+            if (task.state != TaskState::IN_PROGRESS) {
+                return false;
+            }
+            std::erase_if(task.attempts, [&](const Attempt& attempt) {
+                if (now - attempt.last_heartbeat < this->state->task_lease) {
+                    return false;
+                }
+                std::cerr << "Lease of " << taskname << " task " << task.id << " attempt " << attempt.id
+                          << " on worker " << attempt.worker_id << " expired" << std::endl;
+                // The worker is presumed dead, the job doesn't wait to tell it that it finished
+                this->state->workers.erase(attempt.worker_id);
+                return true;
+            });
+            if (task.attempts.empty()) {
+                task.state = TaskState::IDLE;
+                num_in_progress--;
+                return true;
+            }
+            task.start_time = task.attempts.front().start_time;
+            return false;
+        };
+        for (auto& task : this->state->map_tasks) {
+            if (expire(task, this->state->num_in_progress_map_tasks, "map")) {
+                queueIdleMapTask(task);
+            }
+        }
+        for (auto& task : this->state->reduce_tasks) {
+            if (expire(task, this->state->num_in_progress_reduce_tasks, "reduce")) {
+                task.idle_since = now;
+                this->state->idle_reduce_tasks.push_front(task.id);
+            }
+        }
+
+        // A map task that has to run again can't be assigned if every live worker is busy with
+        // a reduce task waiting for that very map task. Only then is the reduce attempt that
+        // started last cancelled to free a worker, and it runs again once the maps are done.
+        // Likewise for a partial task that has to run again, and the reduce tasks of split
+        // partitions waiting for it. A worker that runs a map task, or is between requests, will
+        // take the idle task on its own, so nothing is cancelled while there is one, and the
+        // worker freed by a cancellation takes the task before the next one can happen. A worker
+        // that sent no request for a lease, such as one that died while it had no task, is
+        // presumed dead and not waited for.
+        const bool idle_partial = std::any_of(this->state->idle_reduce_tasks.begin(), this->state->idle_reduce_tasks.end(),
+                                              [this](size_t id) { return this->state->reduce_tasks[id].partial; });
+        if ((this->state->num_idle_map_tasks > 0 || idle_partial) && this->state->num_waiting_workers == 0
+            && this->state->num_in_progress_map_tasks == 0) {
+            ReduceTask* preempted = nullptr;
+            std::unordered_set<std::string> blocked_workers;
+            for (auto& task : this->state->reduce_tasks) {
+                const bool waiting = this->state->num_idle_map_tasks > 0 || !task.partial_tasks.empty();
+                if (task.state != TaskState::IN_PROGRESS || !waiting) {
+                    continue;
+                }
+                for (const auto& attempt : task.attempts) {
+                    blocked_workers.insert(attempt.worker_id);
+                }
+                if (!preempted || task.start_time > preempted->start_time) {
+                    preempted = &task;
+                }
+            }
+            const bool all_blocked = std::all_of(this->state->workers.begin(), this->state->workers.end(), [&](const auto& worker) {
+                return blocked_workers.contains(worker.first) || now - worker.second >= this->state->task_lease;
+            });
+            if (preempted && all_blocked) {
+                std::cerr << "Cancelling reduce task " << preempted->id << " so that idle map tasks can run" << std::endl;
+                preempted->attempts.clear();
+                preempted->state = TaskState::IDLE;
+                preempted->idle_since = now;
+                this->state->idle_reduce_tasks.push_front(preempted->id);
+                this->state->num_in_progress_reduce_tasks--;
+            }
+        }
+
+        // Waiting workers may now get an idle task or a backup attempt
+        this->state->changed.notify_all();
+    }
+
     private:
+    // Assign an idle task to the worker if there is one that can run, the caller holds the lock
+    bool assignTask(const AssignRequest* request, AssignReply* reply) {
+        if (this->state->verbose) {
+            std::cout << "Received AssignRequest from worker: " << request->worker_id() << std::endl;
+            std::cout << "Number of idle map tasks: " << this->state->num_idle_map_tasks << std::endl;
+            std::cout << "Number of idle reduce tasks: " << this->state->idle_reduce_tasks.size() << std::endl;
+            std::cout << "Number of in progress map tasks: " << this->state->num_in_progress_map_tasks << std::endl;
+            std::cout << "Number of in progress reduce tasks: " << this->state->num_in_progress_reduce_tasks << std::endl;
+            std::cout << "Number of completed map tasks: " << this->state->num_completed_map_tasks << std::endl;
+            std::cout << "Number of completed reduce tasks: " << this->state->num_completed_reduce_tasks << std::endl;
+        }
+        
+        // Since a worker is sending an Assign RPC, we can assume that it is idle.
+        // Map tasks always come first. Once they have all been assigned and enough of them have
+        // completed, reduce tasks are assigned too, so that they can fetch and merge the map
+        // outputs while the last map tasks are still running. Backup attempts of stragglers are
+        // only started once there are no idle tasks left in their phase.
+        const size_t num_map_tasks = this->state->map_tasks.size();
+        const bool reduce_ready = this->state->num_idle_map_tasks == 0
+            && this->state->num_completed_map_tasks >= this->state->reduce_slowstart * num_map_tasks;
+
+        MapTask* map_task = nullptr;
+        if (this->state->num_idle_map_tasks > 0) {
+            map_task = nextMapTask(request);
+        } else {
+            map_task = findStraggler(this->state->map_tasks, this->state->map_task_time,
+                                     this->state->num_completed_map_tasks, request->worker_id());
+        }
+        if (map_task) {
+            Attempt& attempt = startAttempt(*map_task, request->worker_id(), this->state->num_in_progress_map_tasks, Histogram::MAP_QUEUE_WAIT_US);
+            this->state->host_inputs[request->host()].insert(map_task->split.filename);
+            // The first attempt writes to the task's intermediate files, backup attempts write
+            // to files of their own, see MapTask
+            if (attempt.id > 0) {
+                attempt.output_filename += "." + std::to_string(attempt.id);
+            }
+
+            reply->set_taskname("map");
+            auto* split = reply->add_input_split();
+            split->set_filename(map_task->split.filename);
+            split->set_offset(map_task->split.offset);
+            split->set_length(map_task->split.length);
+            reply->set_output_filename(attempt.output_filename);
+            reply->set_task_id(map_task->id);
+            reply->set_attempt_id(attempt.id);
+            reply->set_heartbeat_interval_ms(heartbeatInterval());
+            reply->set_num_reducers(this->state->num_reducers);
+            reply->set_sort_buffer_size(this->state->sort_buffer_size);
+            reply->set_intermediate_checksums(this->state->intermediate_checksums);
+            reply->set_hash_order(!this->state->sorted_output);
+            reply->set_compression(mapreduce::compressionName(this->state->compression));
+            for (const auto& boundary : this->state->partition_boundaries) {
+                reply->add_partition_boundary(boundary);
+            }
+            reply->set_sample_keys(this->state->skew_threshold > 0);
+            
+            std::cout << "Assigned map task " << map_task->id << " attempt " << attempt.id << " to worker: " << request->worker_id() << std::endl;
+            return true;
+        }
+
+        if (reduce_ready && !this->state->partitions_planned) {
+            splitLargePartitions();
+        }
+        ReduceTask* reduce_task = nullptr;
+        if (reduce_ready && !this->state->idle_reduce_tasks.empty()) {
+            reduce_task = &this->state->reduce_tasks[this->state->idle_reduce_tasks.front()];
+            this->state->idle_reduce_tasks.pop_front();
+        } else if (this->state->num_completed_map_tasks == num_map_tasks) {
+            // Reduce tasks wait for the map tasks, so they can only be compared once those are done
+            reduce_task = findStraggler(this->state->reduce_tasks, this->state->reduce_task_time,
+                                        this->state->num_completed_reduce_tasks, request->worker_id());
+        }
+        if (reduce_task) {
+            const Attempt& attempt = startAttempt(*reduce_task, request->worker_id(), this->state->num_in_progress_reduce_tasks, Histogram::REDUCE_QUEUE_WAIT_US);
+
+            reply->set_taskname("reduce");
+            reply->set_output_filename(reduce_task->output_filename);
+            reply->set_task_id(reduce_task->id);
+            reply->set_attempt_id(attempt.id);
+            reply->set_heartbeat_interval_ms(heartbeatInterval());
+            reply->set_num_reducers(this->state->num_reducers);
+            reply->set_intermediate_checksums(this->state->intermediate_checksums);
+            reply->set_hash_order(!this->state->sorted_output);
+            reply->set_compression(mapreduce::compressionName(this->state->compression));
+            reply->set_merge_factor(this->state->merge_factor);
+            reply->set_shuffle_compression(this->state->shuffle_compression);
+            reply->set_partial(reduce_task->partial);
+
+            std::cout << "Assigned " << (reduce_task->partial ? "partial " : "") << "reduce task " << reduce_task->id
+                      << " attempt " << attempt.id << " to worker: " << request->worker_id() << std::endl;
+            return true;
+        }
+
+        // There are no idle tasks that can run yet, so we can't assign any to the worker
+        return false;
+    }
+
+    // Queue a map task that became idle again, it is assigned before the other idle tasks
+    void queueIdleMapTask(MapTask& task) {
+        task.idle_since = Clock::now();
+        this->state->idle_map_tasks.push_front(task.id);
+        this->state->idle_map_tasks_by_file[task.split.filename].push_front(task.id);
+        this->state->num_idle_map_tasks++;
+    }
+
+    // Take the first idle map task of a queue, dropping the tasks that are no longer idle
+    MapTask* takeIdleMapTask(std::deque<size_t>& queue) {
+        while (!queue.empty()) {
+            MapTask& task = this->state->map_tasks[queue.front()];
+            queue.pop_front();
+            if (task.state == TaskState::IDLE) {
+                this->state->num_idle_map_tasks--;
+                return &task;
+            }
+        }
+        return nullptr;
+    }
+
+    // Take an idle map task for the worker, preferring the data it is most likely to read fastest:
+    // a split of a file the worker has cached, then of a file already read on its host, and
+    // otherwise the first idle task. There must be at least one idle map task.
+    MapTask* nextMapTask(const AssignRequest* request) {
+        auto take_from_file = [this](const std::string& filename) -> MapTask* {
+            auto it = this->state->idle_map_tasks_by_file.find(filename);
+            if (it == this->state->idle_map_tasks_by_file.end()) {
+                return nullptr;
+            }
+            MapTask* task = takeIdleMapTask(it->second);
+            if (it->second.empty()) {
+                this->state->idle_map_tasks_by_file.erase(it);
+            }
+            return task;
+        };
+
+        for (const auto& filename : request->cached_input()) {
+            if (MapTask* task = take_from_file(filename)) {
+                std::cout << "Map task " << task->id << " reads input cached by worker: " << request->worker_id() << std::endl;
+                return task;
+            }
+        }
+
+        auto host = this->state->host_inputs.find(request->host());
+        if (host != this->state->host_inputs.end()) {
+            for (const auto& filename : host->second) {
+                if (MapTask* task = take_from_file(filename)) {
+                    std::cout << "Map task " << task->id << " reads input already read on host: " << request->host() << std::endl;
+                    return task;
+                }
+            }
+        }
+
+        return takeIdleMapTask(this->state->idle_map_tasks);
+    }
+
+    // Start an attempt of an idle or in progress task on the worker. The time an idle task
+    // waited is recorded in the queue_wait histogram.
+    Attempt& startAttempt(Task& task, const std::string& worker_id, size_t& num_in_progress, Histogram queue_wait) {
+        const auto now = Clock::now();
+        if (task.state == TaskState::IDLE) {
+            Metrics::record(queue_wait, std::chrono::duration_cast<std::chrono::microseconds>(now - task.idle_since).count());
+            task.state = TaskState::IN_PROGRESS;
+            task.start_time = now;
+            num_in_progress++;
+        }
+
+        task.attempts.push_back({task.num_attempts++, worker_id, task.output_filename, now, now});
+        return task.attempts.back();
+    }
+
+    // An attempt failed on its worker, which already removed its files. The task runs again once
+    // no other attempt of it is running, returns true if it is idle again. A task that keeps
+    // failing, such as one whose input makes the user function throw, fails the job.
+    bool failAttempt(Task& task, const Attempt& attempt, size_t& num_in_progress, const char* taskname) {
+        std::cerr << "Attempt " << attempt.id << " of " << taskname << " task " << task.id
+                  << " failed on worker " << attempt.worker_id << std::endl;
+        const uint32_t attempt_id = attempt.id;
+        std::erase_if(task.attempts, [attempt_id](const Attempt& running) { return running.id == attempt_id; });
+        task.num_failures++;
+        if (task.num_failures >= this->state->max_task_failures) {
+            std::cerr << "error: " << taskname << " task " << task.id << " failed " << task.num_failures
+                      << " times, the job fails" << std::endl;
+            this->state->failed = true;
+            this->state->finished = true;
+            this->state->finished_time = Clock::now();
+            this->state->changed.notify_all();
+            return false;
+        }
+        if (!task.attempts.empty()) {
+            task.start_time = task.attempts.front().start_time;
+            return false;
+        }
+        task.state = TaskState::IDLE;
+        num_in_progress--;
+        this->state->changed.notify_all();
+        return true;
+    }
+
+    void completeTask(Task& task) {
+        task.state = TaskState::COMPLETE;
+        task.attempts.clear(); // The other attempts are cancelled on their next heartbeat
+    }
+
+    // A reduce task could not fetch the output of a completed map task from the worker that
+    // ran it, so the map task runs again. Reports of an output that was already replaced are
+    // ignored, several reduce tasks usually notice the same loss.
+    void reexecuteMapTask(const coordinator::LostMapOutput& lost, const std::string& worker_id) {
+        if (lost.map_task_id() >= this->state->map_tasks.size()) {
+            return;
+        }
+        MapTask& task = this->state->map_tasks[lost.map_task_id()];
+        if (task.state != TaskState::COMPLETE || task.shuffle_address != lost.shuffle_address()) {
+            return;
+        }
+        std::cerr << "Worker " << worker_id << " failed to fetch the output of map task " << task.id
+                  << " from " << task.shuffle_address << ", running it again" << std::endl;
+        task.state = TaskState::IDLE;
+        task.shuffle_address.clear();
+        if (task.cached) {
+            // The task runs again like any other, rather than writing into the cache entry
+            task.output_filename = "mr-int-" + std::to_string(task.id);
+            task.cached = false;
+        }
+        this->state->num_completed_map_tasks--;
+        queueIdleMapTask(task);
+        this->state->journal.record({"lost", "map", std::to_string(task.id)});
+        this->state->changed.notify_all();
+    }
+
+    // The reduce task of a split partition could not fetch the output of one of its partial
+    // tasks from the worker that ran it, so the partial task runs again
+    void reexecutePartialTask(const ReduceTask& task, const coordinator::LostMapOutput& lost, const std::string& worker_id) {
+        if (std::find(task.partial_tasks.begin(), task.partial_tasks.end(), lost.map_task_id()) == task.partial_tasks.end()) {
+            return;
+        }
+        ReduceTask& partial = this->state->reduce_tasks[lost.map_task_id()];
+        if (partial.state != TaskState::COMPLETE || partial.shuffle_address != lost.shuffle_address()) {
+            return;
+        }
+        std::cerr << "Worker " << worker_id << " failed to fetch the output of partial reduce task " << partial.id
+                  << " from " << partial.shuffle_address << ", running it again" << std::endl;
+        partial.state = TaskState::IDLE;
+        partial.shuffle_address.clear();
+        partial.idle_since = Clock::now();
+        this->state->num_completed_reduce_tasks--;
+        this->state->idle_reduce_tasks.push_front(partial.id);
+        this->state->changed.notify_all();
+    }
+
+    // Number of outputs a reduce task can fetch so far, as indexed by MapOutputsRequest.start:
+    // the completed map tasks, or the completed partial tasks of a split partition
+    size_t numOutputs(const ReduceTask& task) const {
+        return task.partial_tasks.empty() ? this->state->completed_map_tasks.size() : task.completed_partials.size();
+    }
+
+    bool outputsComplete(const ReduceTask& task) const {
+        if (task.partial_tasks.empty()) {
+            return this->state->num_completed_map_tasks == this->state->map_tasks.size();
+        }
+        return std::all_of(task.partial_tasks.begin(), task.partial_tasks.end(), [this](size_t id) {
+            return this->state->reduce_tasks[id].state == TaskState::COMPLETE;
+        });
+    }
+
+    // Add the partition sizes and heavy hitters reported with the completion of a map task to
+    // those of the job, once per map task
+    void addPartitionSizes(MapTask& task, const CompleteRequest& request) {
+        if (task.sized) {
+            return;
+        }
+        task.sized = true;
+        this->state->has_combine = this->state->has_combine && request.has_combine();
+        for (int p = 0; p < request.partition_size_size() && p < static_cast<int>(this->state->num_reducers); p++) {
+            this->state->partition_records[p] += request.partition_size(p).records();
+            this->state->partition_bytes[p] += request.partition_size(p).bytes();
+        }
+        for (const auto& heavy_hitter : request.heavy_hitter()) {
+            this->state->heavy_hitters.add(heavy_hitter.key(), heavy_hitter.partition(), heavy_hitter.count());
+        }
+    }
+
+    // Split the partitions that are much larger than the others across partial tasks, judging
+    // by the outputs of the map tasks completed so far. Called once, before the first reduce
+    // task is assigned, so no request holds a reference to a reduce task as tasks are added.
+    void splitLargePartitions() {
+        this->state->partitions_planned = true;
+        const auto splits = mapreduce::planPartitionSplits(this->state->partition_bytes, this->state->skew_threshold,
+                                                           this->state->max_partition_splits);
+        uint64_t total = 0;
+        for (uint64_t bytes : this->state->partition_bytes) {
+            total += bytes;
+        }
+        for (size_t r = 0; r < splits.size(); r++) {
+            const size_t num_splits = std::min(splits[r], this->state->map_tasks.size());
+            if (num_splits < 2 || this->state->reduce_tasks[r].state != TaskState::IDLE) {
+                continue;
+            }
+            std::cout << "Partition " << r << " holds " << this->state->partition_bytes[r] * 100 / total
+                      << "% of the map output so far";
+            if (!this->state->has_combine) {
+                std::cout << ", it can't be split without a combine function" << std::endl;
+                continue;
+            }
+            std::cout << ", splitting it across " << num_splits << " partial tasks" << std::endl;
+
+            // The partial tasks are assigned first, and the reduce task of the partition last
+            std::erase(this->state->idle_reduce_tasks, r);
+            this->state->idle_reduce_tasks.push_back(r);
+            for (size_t split = 0; split < num_splits; split++) {
+                ReduceTask partial;
+                partial.state = TaskState::IDLE;
+                partial.id = this->state->reduce_tasks.size();
+                partial.partition = r;
+                partial.partial = true;
+                partial.split = split;
+                partial.num_splits = num_splits;
+                partial.output_filename = "mr-part-" + std::to_string(r) + "-" + std::to_string(split);
+                partial.idle_since = Clock::now();
+                this->state->reduce_tasks[r].partial_tasks.push_back(partial.id);
+                this->state->idle_reduce_tasks.push_front(partial.id);
+                this->state->reduce_tasks.push_back(std::move(partial));
+            }
+        }
+    }
+
+    // Returns the in progress task that has run the longest with a single attempt, if it has
+    // run long enough to be considered a straggler and isn't running on the worker
+    template <typename T>
+    T* findStraggler(std::vector<T>& tasks, Clock::duration completed_time, size_t num_completed, const std::string& worker_id) {
+        if (!this->state->speculative_execution || num_completed == 0) {
+            return nullptr;
+        }
+        const auto threshold = std::chrono::duration_cast<Clock::duration>(
+            completed_time / num_completed * this->state->speculation_slowness);
+        const auto now = Clock::now();
+
+        T* straggler = nullptr;
+        for (auto& task : tasks) {
+            if (task.state != TaskState::IN_PROGRESS || task.attempts.size() != 1
+                || task.attempts.front().worker_id == worker_id || now - task.start_time < threshold) {
+                continue;
+            }
+            if (!straggler || task.start_time < straggler->start_time) {
+                straggler = &task;
+            }
+        }
+        if (straggler) {
+            std::cout << "Starting a backup attempt of straggler task " << straggler->id << std::endl;
+        }
+        return straggler;
+    }
+
+    // Record that a request of the worker was received, see JobState::workers
+    void markAlive(const std::string& worker_id) {
+        this->state->workers[worker_id] = Clock::now();
+    }
+
+    // Renew the lease of a running attempt, returns false if the attempt is not running
+    bool renewLease(Task& task, const std::string& worker_id, uint32_t attempt_id) {
+        Attempt* attempt = task.findAttempt(worker_id, attempt_id);
+        if (task.state != TaskState::IN_PROGRESS || !attempt) {
+            return false;
+        }
+        attempt->last_heartbeat = Clock::now();
+        return true;
+    }
+
+    // Add the metrics of a CompleteRequest to those of the job, metrics unknown to this
+    // coordinator are ignored
+    void addWorkerMetrics(const CompleteRequest& request) {
+        mapreduce::MetricValues& metrics = this->state->worker_metrics;
+        for (const auto& [name, value] : request.counters()) {
+            auto it = std::find(mapreduce::counter_names.begin(), mapreduce::counter_names.end(), name);
+            if (it != mapreduce::counter_names.end()) {
+                metrics.counters[it - mapreduce::counter_names.begin()] += value;
+            }
+        }
+        for (const auto& histogram : request.histograms()) {
+            auto it = std::find(mapreduce::histogram_names.begin(), mapreduce::histogram_names.end(), histogram.name());
+            if (it == mapreduce::histogram_names.end()) {
+                continue;
+            }
+            const size_t h = it - mapreduce::histogram_names.begin();
+            for (int b = 0; b < histogram.bucket_size() && b < static_cast<int>(metrics.num_buckets); b++) {
+                metrics.buckets[h][b] += histogram.bucket(b);
+            }
+            metrics.sums[h] += histogram.sum();
+        }
+    }
+
+    uint32_t heartbeatInterval() const {
+        return std::max<uint32_t>(this->state->task_lease.count() / 3, 1);
+    }
+
     std::shared_ptr<JobState> state;
 };
 
@@ -225,14 +984,58 @@ namespace mapreduce {
         size_t num_mappers;
         size_t num_reducers;
         size_t max_segment_size;
+        size_t sort_buffer_size = 32 * 1024 * 1024; // Memory used to buffer the output of a map task
+        double reduce_slowstart = 0.05; // Fraction of the map tasks that complete before reduce tasks start
+        size_t merge_factor = 10; // Number of runs a reduce task merges at once while the map tasks run
+        bool intermediate_checksums = false; // Checksum every block of the intermediate files
+        bool sorted_output = true; // If false, keys are grouped by hash, which sorts faster but leaves the output unsorted
+        std::chrono::milliseconds task_lease = std::chrono::seconds(10); // Time without a heartbeat after which a task attempt is abandoned
+        bool speculative_execution = true; // Start backup attempts of straggler tasks at the end of each phase
+        double speculation_slowness = 1.5; // How many times slower than average a task has to be to get a backup attempt
+        bool shuffle_compression = false; // Compress the intermediate files fetched from other workers
+        Compression compression = Compression::NONE; // Codec of the blocks of the intermediate files, see compression.hpp
+        // If not empty, keys are range partitioned at these num_reducers - 1 sorted boundaries
+        // instead of hashed, so the sorted reduce outputs only have to be concatenated
+        std::vector<std::string> partition_boundaries;
+        // A partition with more than skew_threshold times the average size of the others is
+        // split across up to max_partition_splits tasks, whose results are combined before
+        // they are reduced. Only jobs with a combine function are split. Off (0) by default: the
+        // sizes are estimated from the map tasks completed when the first reduce task is
+        // assigned, so a job that turns it on should also raise reduce_slowstart.
+        double skew_threshold = 0;
+        size_t max_partition_splits = 4;
+        // Journal of the completed tasks, <output_filename>.journal if empty. With resume, the
+        // tasks that completed before the coordinator stopped are not run again.
+        std::string journal_filename;
+        bool resume = false;
+        // Map outputs are kept in cache_dir across runs, and the splits whose file, map function
+        // (the shared object so_filename, as loaded by the workers) and job settings didn't
+        // change are not mapped again. Files are compared by size and modification time, or by
+        // contents with cache_hash_contents. The cache must be on the filesystem shared with the
+        // workers, only the outputs of map tasks read from it are stored, and every job needs a
+        // cache directory of its own. Not used by local jobs.
+        std::string cache_dir;
+        std::string so_filename;
+        bool cache_hash_contents = false;
+        // Counters and histograms of the job are written to this JSON file once it completes,
+        // <output_filename>.profile.json if empty
+        std::string profile_filename;
+        // Log every request and the tasks of the job
+        bool verbose = false;
+        // Run the job in this process with the mapper and reducer below, on a pool of
+        // local_threads threads (0 for one per core) instead of on workers. Intermediate records
+        // are shuffled in memory, and only spilled to files past local_memory_limit bytes.
+        bool local = false;
+        size_t local_threads = 0;
+        size_t local_memory_limit = 256 * 1024 * 1024;
         size_t num_assigned_mappers = 0;
         size_t num_assigned_reducers = 0;
         std::string server_address;
         
         std::vector<Task> tasks;
 
-        Mapper* mapper;
-        Reducer* reducer;
+        Mapper* mapper = nullptr;
+        Reducer* reducer = nullptr;
 
         void execute() {
             std::cout << "executing mapreduce job" << std::endl;
@@ -242,24 +1045,27 @@ namespace mapreduce {
             std::cout << "number of mappers: " << this->num_mappers << std::endl;
             std::cout << "number of reducers: " << this->num_reducers << std::endl;
             std::cout << "max segment size: " << this->max_segment_size << std::endl;
+            std::cout << "intermediate compression: " << compressionName(this->compression) << std::endl;
+            std::cout << "local: " << (this->local ? "true" : "false") << std::endl;
 
-            std::vector<std::string> segments = std::move(inputSegments());
-
-            std::cout << "number of segments: " << segments.size() << std::endl;
-            std::cout << "segment sizes (bytes): ";
-            for (const auto& segment : segments) {
-                std::cout << segment.size() << " ";
+            if (this->num_reducers == 0) {
+                std::cerr << "error: number of reducers must be greater than 0" << std::endl;
+                return;
+            }
+            if (!this->partition_boundaries.empty()
+                && (this->partition_boundaries.size() != this->num_reducers - 1
+                    || !std::is_sorted(this->partition_boundaries.begin(), this->partition_boundaries.end()))) {
+                std::cerr << "error: partition boundaries must be num_reducers - 1 sorted keys" << std::endl;
+                return;
             }
-            std::cout << std::endl;
 
-            // Write all segments to disk in a temporary directory
-            std::filesystem::path segments_dir("segments");
-            std::filesystem::create_directory(segments_dir);
-            for (size_t i = 0; i < segments.size(); i++) {
-                std::ofstream segment_file;
-                segment_file.open("segments/segment_" + std::to_string(i));
-                segment_file << segments[i];
-                segment_file.close();
+            // Splits are computed from the file sizes only, the input is not read until the map tasks run
+            std::vector<mapreduce::InputSplit> splits = inputSplits();
+            std::cout << "number of splits: " << splits.size() << std::endl;
+
+            if (this->local) {
+                executeLocal(splits);
+                return;
             }
 
             // Initializate job state
@@ -267,46 +1073,71 @@ namespace mapreduce {
             state->num_mappers = this->num_mappers;
             state->num_reducers = this->num_reducers;
             state->segment_size = this->max_segment_size;
-            state->num_segments = segments.size();
-            state->num_idle_map_tasks = segments.size(); // Should we let the user set this?
-            state->num_idle_reduce_tasks = this->num_reducers;
+            state->sort_buffer_size = this->sort_buffer_size;
+            state->intermediate_checksums = this->intermediate_checksums;
+            state->sorted_output = this->sorted_output;
+            state->task_lease = this->task_lease;
+            state->speculative_execution = this->speculative_execution;
+            state->speculation_slowness = this->speculation_slowness;
+            state->shuffle_compression = this->shuffle_compression;
+            state->compression = this->compression;
+            state->partition_boundaries = this->partition_boundaries;
+            state->reduce_slowstart = this->reduce_slowstart;
+            state->merge_factor = std::max<size_t>(this->merge_factor, 2);
+            state->skew_threshold = this->skew_threshold;
+            state->max_partition_splits = this->max_partition_splits;
+            state->partition_records.assign(this->num_reducers, 0);
+            state->partition_bytes.assign(this->num_reducers, 0);
+            state->num_segments = splits.size();
             state->finished = false;
+            state->verbose = this->verbose;
+            state->start_time = Clock::now();
             
             // Initialize map tasks
             std::cout << "Initializing map tasks" << std::endl;
-            std::vector<std::string> segment_filenames;
-            for (size_t i = 0; i < segments.size(); i++) {
+            for (size_t i = 0; i < splits.size(); i++) {
                 MapTask map_task;
                 map_task.state = TaskState::IDLE;
-                map_task.input_filename = "segments/segment_" + std::to_string(i);
+                map_task.id = i;
+                map_task.split = splits[i];
                 map_task.output_filename = "mr-int-" + std::to_string(i);
+                map_task.idle_since = state->start_time;
                 state->map_tasks.push_back(map_task);
-                segment_filenames.push_back(map_task.output_filename);
-                printMapTask(map_task);
+                state->idle_map_tasks.push_back(map_task.id);
+                state->idle_map_tasks_by_file[map_task.split.filename].push_back(map_task.id);
+                state->num_idle_map_tasks++;
+                if (this->verbose) {
+                    printMapTask(map_task);
+                }
             }
             
-            size_t segments_per_reducer = (segments.size() + 1) / this->num_reducers;
-            std::cout << "segments_per_reducer: " << segments_per_reducer << std::endl;
-            size_t j = 0;
+            // Every map task partitions its output into num_reducers files, and reduce task i
+            // reads partition i from every map task.
             for (size_t i = 0; i < this->num_reducers; i++) {
-                std::vector<std::string> input_filenames;
-                while (j < segments.size() && input_filenames.size() < segments_per_reducer) {
-                    input_filenames.push_back(segment_filenames[j]);
-                    j++;
-                }
-                
-                // Print all the input filenames for the reduce tasks
-                std::cout << "input_filenames for reduce task " << i << ": ";
-                for (const auto& filename : input_filenames) {
-                    std::cout << filename << " ";
-                }
-                std::cout << std::endl;
-
                 ReduceTask reduce_task;
                 reduce_task.state = TaskState::IDLE;
-                reduce_task.input_filenames = input_filenames;
+                reduce_task.id = i;
+                reduce_task.partition = i;
                 reduce_task.output_filename = "mr-out-" + std::to_string(i);
+                reduce_task.idle_since = state->start_time;
                 state->reduce_tasks.push_back(reduce_task);
+                state->idle_reduce_tasks.push_back(reduce_task.id);
+            }
+
+            const std::string journal_filename = this->journal_filename.empty() ? this->output_filename + ".journal" : this->journal_filename;
+            if (this->resume && !resumeJob(*state, journal_filename)) {
+                return;
+            }
+            if (!state->journal.open(journal_filename, this->resume)) {
+                std::cerr << "error: failed to open journal " << journal_filename << std::endl;
+                return;
+            }
+            if (!this->resume) {
+                state->journal.record({"job", std::to_string(state->map_tasks.size()), std::to_string(state->reduce_tasks.size())});
+            }
+            std::unique_ptr<MapOutputCache> cache = openCache();
+            if (cache) {
+                reuseCachedOutputs(*state, *cache);
             }
             
             // Start the RPC server
@@ -320,66 +1151,448 @@ namespace mapreduce {
             std::unique_ptr<Server> server(builder.BuildAndStart());
             std::cout << "Server listening on " << server_address << std::endl;
 
-            // Create a seperate thread to monitor the job completion status
-            std::thread job_monitor_thread([state, &server] {
-                while (true) {
-                    if (state->finished) {
-                        server->Shutdown();
-                        std::cout << "Server shutdown" << std::endl;
-                        break;
+            // Create a seperate thread that shuts the server down once the job completes. Requests
+            // that are long polling are woken up by the same notification, and the server stays up
+            // until every worker has been told that the job finished, so that workers which are
+            // about to ask for another task don't find the server gone. Until then, the monitor
+            // periodically abandons the attempts of workers that stopped sending heartbeats.
+            std::thread job_monitor_thread([state, &server, &service] {
+                {
+                    std::unique_lock<std::mutex> lock(state->mutex);
+                    while (!state->changed.wait_for(lock, state->monitor_interval, [&] { return state->finished.load(); })) {
+                        service.expireAttempts();
                     }
-                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                    state->changed.wait_for(lock, state->long_poll_timeout, [&] {
+                        return state->finished_workers.size() == state->workers.size();
+                    });
                 }
+                // Calls from workers that stopped responding are cancelled rather than waited for
+                server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
+                std::cout << "Server shutdown" << std::endl;
             });
 
             server->Wait();
             job_monitor_thread.join();
 
-            // Clean up the temporary directory
-            std::cout << "Cleaning up temporary directory" << std::endl;
-            std::filesystem::remove_all(segments_dir);
+            if (state->failed) {
+                std::cerr << "error: MapReduce job failed, no output was written" << std::endl;
+            } else if (state->finished) {
+                const auto output_start = Clock::now();
+                if (writeOutput(*state)) {
+                    writeJobProfile(*state, output_start);
+                    if (cache) {
+                        storeCachedOutputs(*state, *cache);
+                    }
+                }
+            }
+        }
+
+        // Open the map output cache, nullptr if the job doesn't use one or it can't be opened
+        std::unique_ptr<MapOutputCache> openCache() {
+            if (this->cache_dir.empty()) {
+                return nullptr;
+            }
+            const uint64_t so_hash = this->so_filename.empty() ? 0 : hashFile(this->so_filename);
+            if (so_hash == 0) {
+                std::cerr << "error: the map output cache needs the shared object of the job, "
+                          << (this->so_filename.empty() ? "none was given" : "failed to read " + this->so_filename) << std::endl;
+                return nullptr;
+            }
+            // Everything besides the input that the intermediate files depend on
+            Fingerprint job;
+            job.field("map-output-v1").field(so_hash).field(this->num_reducers).field(this->sorted_output)
+               .field(this->intermediate_checksums).field(compressionName(this->compression));
+            for (const auto& boundary : this->partition_boundaries) {
+                job.field(boundary);
+            }
+            auto cache = std::make_unique<MapOutputCache>(this->cache_dir, job.value(), this->num_reducers, this->cache_hash_contents);
+            if (!cache->open()) {
+                std::cerr << "error: failed to open the map output cache " << this->cache_dir << std::endl;
+                return nullptr;
+            }
+            return cache;
+        }
+
+        // Complete the idle map tasks whose output is in the cache, their output is read from it
+        void reuseCachedOutputs(JobState& state, MapOutputCache& cache) {
+            size_t num_reused = 0;
+            for (auto& task : state.map_tasks) {
+                task.fingerprint = cache.fingerprint(task.split);
+                if (task.state != TaskState::IDLE) {
+                    continue;
+                }
+                const std::string prefix = cache.lookup(task.fingerprint);
+                if (prefix.empty()) {
+                    continue;
+                }
+                task.state = TaskState::COMPLETE;
+                task.output_filename = prefix;
+                task.cached = true;
+                task.sized = true;
+                for (size_t r = 0; r < state.num_reducers; r++) {
+                    std::error_code error;
+                    const auto size = std::filesystem::file_size(intermediateFilename(task, r), error);
+                    state.partition_bytes[r] += error ? 0 : size;
+                }
+                state.completed_map_tasks.push_back(task.id);
+                state.num_completed_map_tasks++;
+                state.num_idle_map_tasks--; // Dropped from the idle queues when it reaches the front
+                num_reused++;
+            }
+            if (state.num_completed_map_tasks == state.map_tasks.size()) {
+                state.maps_completed_time = state.start_time;
+            }
+            std::cout << "Reusing the cached outputs of " << num_reused << " of " << state.map_tasks.size()
+                      << " map tasks from " << this->cache_dir << std::endl;
+        }
+
+        // Store the outputs of the map tasks of a completed job in the cache, and drop the
+        // entries of inputs that are gone or changed
+        void storeCachedOutputs(const JobState& state, MapOutputCache& cache) {
+            size_t num_stored = 0;
+            for (const auto& task : state.map_tasks) {
+                // Outputs served by the workers are not on the shared filesystem
+                if (task.cached || task.state != TaskState::COMPLETE || !task.shuffle_address.empty()) {
+                    continue;
+                }
+                if (cache.store(task.fingerprint, task.output_filename)) {
+                    num_stored++;
+                } else {
+                    std::cerr << "error: failed to cache the output of map task " << task.id << std::endl;
+                }
+            }
+            const size_t num_pruned = cache.prune();
+            std::cout << "Cached the outputs of " << num_stored << " map tasks, removed " << num_pruned
+                      << " stale entries from " << this->cache_dir << std::endl;
+        }
+
+        // Write the profile of a completed job: its phase times, the counters and histograms
+        // reported by the workers, and those of the coordinator
+        void writeJobProfile(const JobState& state, Clock::time_point output_start) {
+            auto ms = [](Clock::time_point from, Clock::time_point to) -> uint64_t {
+                return to > from ? std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count() : 0;
+            };
+            // Tasks that completed before a resume are not timed
+            const auto maps_completed = std::max(state.maps_completed_time, state.start_time);
+            const auto finished = std::max(state.finished_time, maps_completed);
+            const auto now = Clock::now();
+
+            MetricValues metrics = state.worker_metrics;
+            metrics.merge(Metrics::snapshot());
+
+            // The sizes of the partitions and the most frequent keys show how skewed the job is
+            size_t num_split_partitions = 0;
+            for (const auto& task : state.reduce_tasks) {
+                num_split_partitions += !task.partial_tasks.empty();
+            }
+            std::ostringstream skew;
+            skew << "  \"partition_bytes\": [";
+            for (size_t p = 0; p < state.partition_bytes.size(); p++) {
+                skew << (p > 0 ? ", " : "") << state.partition_bytes[p];
+            }
+            skew << "],\n  \"heavy_hitters\": [";
+            const auto heavy_hitters = state.heavy_hitters.top(16);
+            for (size_t i = 0; i < heavy_hitters.size(); i++) {
+                skew << (i > 0 ? "," : "") << "\n    {\"key\": ";
+                writeJsonString(skew, heavy_hitters[i].key);
+                skew << ", \"count\": " << heavy_hitters[i].count << ", \"partition\": " << heavy_hitters[i].partition << "}";
+            }
+            skew << "\n  ],\n";
+
+            writeProfile("distributed", {
+                {"map_tasks", state.map_tasks.size()},
+                {"reduce_tasks", state.reduce_tasks.size()},
+                {"split_partitions", num_split_partitions},
+                {"wall_ms", ms(state.start_time, now)},
+                {"output_ms", ms(output_start, now)},
+            }, ms(state.start_time, maps_completed), ms(maps_completed, finished), metrics, skew.str());
+        }
+
+        // Write a JSON job profile to profile_filename, with the phase times and the rates
+        // derived from them. members are written as is after the fields, each followed by a
+        // comma. Returns false if it could not be written.
+        bool writeProfile(const std::string& mode, std::vector<std::pair<std::string, uint64_t>> fields,
+                          uint64_t map_ms, uint64_t reduce_ms, const MetricValues& metrics, const std::string& members = "") {
+            auto per_second = [](uint64_t n, uint64_t ms) -> uint64_t {
+                return ms > 0 ? n * 1000 / ms : 0;
+            };
+            fields.push_back({"map_phase_ms", map_ms});
+            fields.push_back({"reduce_phase_ms", reduce_ms});
+            fields.push_back({"map_input_bytes_per_s", per_second(metrics.counter(Counter::MAP_INPUT_BYTES), map_ms)});
+            fields.push_back({"map_output_records_per_s", per_second(metrics.counter(Counter::MAP_OUTPUT_RECORDS), map_ms)});
+            fields.push_back({"reduce_input_records_per_s", per_second(metrics.counter(Counter::REDUCE_INPUT_RECORDS), reduce_ms)});
+
+            const std::string filename = this->profile_filename.empty() ? this->output_filename + ".profile.json" : this->profile_filename;
+            std::ofstream out(filename, std::ios::trunc);
+            out << "{\n  \"mode\": \"" << mode << "\",\n";
+            for (const auto& [name, value] : fields) {
+                out << "  \"" << name << "\": " << value << ",\n";
+            }
+            out << members;
+            metrics.writeJson(out, "  ");
+            out << "\n}\n";
+            out.close();
+            if (out.fail()) {
+                std::cerr << "error: failed to write the job profile " << filename << std::endl;
+                return false;
+            }
+            std::cout << "Wrote the job profile to " << filename << std::endl;
+            return true;
+        }
+
+        // Called by Mapper::map for every intermediate record of a local job
+        void emitIntermediate(std::string_view key, std::string_view value) {
+            LocalTask* task = local_task;
+            if (!task || !task->map) {
+                std::cerr << "error: emitIntermediate called outside of a local map task" << std::endl;
+                return;
+            }
+            const size_t partition = this->partition_boundaries.empty()
+                ? defaultPartition(key, this->num_reducers)
+                : rangePartition(key, this->partition_boundaries);
+            task->runs[partition]->add(key, value);
+            task->records++;
+            task->bytes += key.size() + value.size() + local_record_overhead;
+            if (task->bytes >= task->buffer_size) {
+                flushLocalTask(*task);
+            }
+        }
+
+        // Called by Reducer::reduce for every output record of a local job
+        void emit(std::string_view key, std::string_view value) {
+            LocalTask* task = local_task;
+            if (!task || task->map) {
+                std::cerr << "error: emit called outside of a local reduce task" << std::endl;
+                return;
+            }
+            // Keyed like the reduce outputs of a distributed job, see outputLine
+            outputLine(task->output_line, key, value);
+            task->runs[0]->add(task->reduce_key, task->output_line);
+            task->records++;
+            task->bytes += task->reduce_key.size() + task->output_line.size() + local_record_overhead;
+            if (task->bytes >= task->buffer_size) {
+                flushLocalTask(*task);
+            }
+        }
+
+        // Run the job in this process. Every split is mapped on the thread pool into sorted runs
+        // per partition, which are handed to an in-memory shuffle whenever the task's share of
+        // the memory limit is full. Every partition is then merged and reduced on the pool, and
+        // the reduce outputs, kept in a second shuffle, are written to output_filename.
+        bool executeLocal(const std::vector<InputSplit>& splits);
+
+        // Replay the journal of a previous run of the job, and mark the tasks it completed as
+        // complete. Tasks whose output files are gone run again, as do map tasks served by
+        // workers that are gone, once the reduce tasks fail to fetch their output. Returns
+        // false if the journal is for another job or the job already completed.
+        bool resumeJob(JobState& state, const std::string& journal_filename) {
+            const auto records = JobJournal::read(journal_filename);
+            if (records.empty() || records[0].size() != 3 || records[0][0] != "job"
+                || records[0][1] != std::to_string(state.map_tasks.size())
+                || records[0][2] != std::to_string(state.reduce_tasks.size())) {
+                std::cerr << "error: " << journal_filename << " is not a journal of this job" << std::endl;
+                return false;
+            }
+
+            for (const auto& record : records) {
+                if (record.size() == 2 && record[0] == "complete" && record[1] == "output") {
+                    std::cout << "The job already completed, its output is in " << this->output_filename << std::endl;
+                    return false;
+                }
+                if (record.size() < 3 || (record[1] != "map" && record[1] != "reduce")) {
+                    continue;
+                }
+                size_t id = 0;
+                const auto [end, error] = std::from_chars(record[2].data(), record[2].data() + record[2].size(), id);
+                const size_t num_tasks = record[1] == "map" ? state.map_tasks.size() : state.reduce_tasks.size();
+                if (error != std::errc() || end != record[2].data() + record[2].size() || id >= num_tasks) {
+                    std::cerr << "Skipping invalid journal record: " << record[0] << " " << record[1] << " " << record[2] << std::endl;
+                    continue;
+                }
+                if (record[1] == "map") {
+                    MapTask& task = state.map_tasks[id];
+                    if (record[0] == "complete" && record.size() >= 4) {
+                        task.state = TaskState::COMPLETE;
+                        task.output_filename = record[3];
+                        task.shuffle_address = record.size() >= 5 ? record[4] : "";
+                    } else if (record[0] == "lost") {
+                        task.state = TaskState::IDLE;
+                    }
+                } else if (record[0] == "complete") {
+                    state.reduce_tasks[id].state = TaskState::COMPLETE;
+                }
+            }
+
+            // Outputs read from the shared filesystem must still be there
+            for (auto& task : state.map_tasks) {
+                if (task.state != TaskState::COMPLETE) {
+                    continue;
+                }
+                for (size_t r = 0; r < state.reduce_tasks.size() && task.shuffle_address.empty(); r++) {
+                    if (!std::filesystem::exists(intermediateFilename(task, r))) {
+                        task.state = TaskState::IDLE;
+                        break;
+                    }
+                }
+                if (task.state == TaskState::COMPLETE) {
+                    state.completed_map_tasks.push_back(task.id);
+                    state.num_completed_map_tasks++;
+                    state.num_idle_map_tasks--; // Dropped from the idle queues when it reaches the front
+                }
+            }
+            for (auto& task : state.reduce_tasks) {
+                if (task.state == TaskState::COMPLETE && !std::filesystem::exists(task.output_filename)) {
+                    task.state = TaskState::IDLE;
+                }
+                if (task.state == TaskState::COMPLETE) {
+                    std::erase(state.idle_reduce_tasks, task.id);
+                    state.num_completed_reduce_tasks++;
+                }
+            }
+            state.finished = state.num_completed_reduce_tasks == state.reduce_tasks.size();
+
+            std::cout << "Resuming the job with " << state.num_completed_map_tasks << " map tasks and "
+                      << state.num_completed_reduce_tasks << " reduce tasks already completed" << std::endl;
+            return true;
+        }
+
+        // Write the outputs of the reduce tasks to output_filename, in partition order, and
+        // remove them once the output is complete
+        bool writeOutput(JobState& state) {
+            std::vector<std::string> filenames;
+            std::vector<std::string> partial_filenames;
+            for (const auto& task : state.reduce_tasks) {
+                (task.partial ? partial_filenames : filenames).push_back(task.output_filename);
+            }
+
+            // Range partitions are already in order, and hash-ordered output isn't sorted, so in
+            // both cases the outputs are concatenated instead of merged
+            const bool concatenate = !state.sorted_output || !state.partition_boundaries.empty();
+            std::cout << (concatenate ? "Concatenating " : "Merging ") << filenames.size()
+                      << " reduce outputs into " << this->output_filename << std::endl;
+            // The output is renamed into place once it is complete, so it is never seen half written
+            const std::string temp_filename = this->output_filename + ".tmp";
+            this->output_file.open(temp_filename, std::ios::binary | std::ios::trunc);
+            if (!this->output_file.is_open()) {
+                std::cerr << "error: failed to open output file " << temp_filename << std::endl;
+                return false;
+            }
+            try {
+                if (!writeFinalOutput(filenames, this->output_file, concatenate)) {
+                    std::cerr << "error: failed to write output file " << this->output_filename << std::endl;
+                    return false;
+                }
+            } catch (const std::runtime_error& e) {
+                std::cerr << "error: failed to read the reduce outputs: " << e.what() << std::endl;
+                return false;
+            }
+            this->output_file.close();
+            std::filesystem::rename(temp_filename, this->output_filename);
+            state.journal.record({"complete", "output"});
+
+            for (const auto& filename : filenames) {
+                std::filesystem::remove(filename);
+            }
+            // Partial outputs served by a worker are on its host, like the intermediate files
+            for (const auto& filename : partial_filenames) {
+                std::filesystem::remove(filename);
+            }
+            return true;
         }
         
-        std::vector<std::string> inputSegments() {
-            // Read input files, and split each of them into segments, and write them to the local disk
-            std::vector<std::string> segments;
+        std::vector<mapreduce::InputSplit> inputSplits() {
+            // Cut every input file into splits of at most max_segment_size bytes. The files are
+            // sorted so that the splits, and so the map task ids, don't depend on directory order.
+            std::vector<std::filesystem::path> paths;
             for (const auto& entry : std::filesystem::directory_iterator(this->input_dir_name)) {
                 const auto& path = entry.path();
                 if (std::filesystem::is_regular_file(path)) {
-                    std::ifstream file(path);
-                    std::string buffer;
-                    std::string line;
-                    buffer.reserve(this->max_segment_size);
-                    while (std::getline(file, line)) {
-                        // If a single line is greater than the maximum segment size,
-                        // we cut the first 16MB of the line and emit it as a segment
-                        // repeatedly until the entire line is emitted
-                        if (line.size() > this->max_segment_size) {
-                            size_t start = 0;
-                            while (start < line.size()) {
-                                segments.push_back(line.substr(start, this->max_segment_size));
-                                start += this->max_segment_size;
-                            }
-                        } else if (buffer.size() + line.size() > this->max_segment_size) {
-                            // If the buffer is full, then we emit the segment and clear the buffer
-                            // to make space for the current line
-                            segments.push_back(buffer);
-                            buffer.clear();
-                        }
-
-                        if (!line.empty())
-                            buffer += line + "\n";
-                    }
-
-                    segments.push_back(buffer);
+                    paths.push_back(path);
                 } else {
                     std::cerr << "error: " << path << " is not a regular file, and will be ignored" << std::endl;
                 }
             }
+            std::sort(paths.begin(), paths.end());
+
+            std::vector<mapreduce::InputSplit> splits;
+            for (const auto& path : paths) {
+                const uint64_t size = std::filesystem::file_size(path);
+                for (uint64_t offset = 0; offset < size; offset += this->max_segment_size) {
+                    splits.push_back({path.string(), offset, std::min<uint64_t>(this->max_segment_size, size - offset)});
+                }
+            }
             
-            return segments;
+            return splits;
+        }
+
+    private:
+        // A map or reduce task of a local job. Its records are buffered in a run per partition
+        // (a single one for the output of a reduce task), and handed to the shuffle once the
+        // task's buffer is full and when it ends.
+        struct LocalTask {
+            LocalTask(bool map, size_t num_runs, size_t partition, size_t buffer_size, KeyOrder order, LocalShuffle& shuffle)
+                : map(map), partition(partition), buffer_size(buffer_size), order(order), shuffle(shuffle) {
+                for (size_t i = 0; i < num_runs; i++) {
+                    this->runs.push_back(std::make_unique<MemoryRun>());
+                }
+            }
+
+            bool map;
+            size_t partition; // Of a reduce task
+            size_t buffer_size;
+            KeyOrder order;
+            LocalShuffle& shuffle;
+            std::vector<std::unique_ptr<MemoryRun>> runs;
+            size_t records = 0; // Emitted by the task
+            size_t bytes = 0; // Buffered in the runs
+            bool failed = false;
+            std::string_view reduce_key; // Key whose values are being reduced
+            std::string output_line;
+        };
+
+        // Approximate memory used by a buffered record besides its key and value
+        static constexpr size_t local_record_overhead = 34;
+
+        // The task run by the calling thread, emitIntermediate and emit write to it
+        inline static thread_local LocalTask* local_task = nullptr;
+
+        // Run func as the task of the calling thread, and flush what it emitted
+        template <typename Func>
+        void runLocalTask(LocalTask& task, Func func) {
+            LocalTask* previous = local_task;
+            local_task = &task;
+            try {
+                func();
+            } catch (...) {
+                local_task = previous;
+                throw;
+            }
+            local_task = previous;
+            flushLocalTask(task);
+        }
+
+        // Hand the buffered runs of a task to the shuffle, the runs of a map task are sorted first
+        void flushLocalTask(LocalTask& task) {
+            for (size_t i = 0; i < task.runs.size(); i++) {
+                if (task.runs[i]->size() == 0) {
+                    continue;
+                }
+                if (task.map) {
+                    ScopedTimer timer(Counter::SPILL_SORT_NS);
+                    task.runs[i]->sort(task.order);
+                }
+                if (!task.shuffle.add(task.map ? i : task.partition, std::move(task.runs[i]))) {
+                    std::cerr << "error: failed to spill the records of a local task" << std::endl;
+                    task.failed = true;
+                }
+                task.runs[i] = std::make_unique<MemoryRun>();
+            }
+            task.bytes = 0;
+        }
+
+        static long long elapsedMs(Clock::time_point start_time) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start_time).count();
         }
-        
     };
 
     class Mapper {
@@ -391,6 +1604,130 @@ namespace mapreduce {
     public:
         virtual void reduce(MapReduceSpec& mr, const std::string& key, std::vector<std::string> intermediate_values) = 0;
     };
+
+    // Defined here, as it calls the mapper and the reducer
+    inline bool MapReduceSpec::executeLocal(const std::vector<InputSplit>& splits) {
+        if (!this->mapper || !this->reducer) {
+            std::cerr << "error: a local job needs a mapper and a reducer" << std::endl;
+            return false;
+        }
+        const size_t num_threads = this->local_threads > 0
+            ? this->local_threads : std::max(1u, std::thread::hardware_concurrency());
+        const KeyOrder order = this->sorted_output ? KeyOrder::BYTES : KeyOrder::HASH;
+        const size_t buffer_size = std::max<size_t>(
+            std::min(this->sort_buffer_size, this->local_memory_limit / num_threads), 1024 * 1024);
+        WriterOptions options;
+        options.checksums = this->intermediate_checksums;
+        options.compression = this->compression;
+
+        std::cout << "Running the job locally on " << num_threads << " threads" << std::endl;
+        const auto start_time = Clock::now();
+        const MetricValues start_metrics = Metrics::snapshot();
+        Clock::time_point maps_completed;
+        Clock::time_point finished;
+        ThreadPool pool(num_threads);
+        LocalShuffle shuffle(this->num_reducers, this->local_memory_limit, this->output_filename + ".spill", options);
+        LocalShuffle outputs(this->num_reducers, this->local_memory_limit, this->output_filename + ".out", options);
+        std::atomic<bool> failed = false;
+
+        try {
+            pool.parallelFor(splits.size(), [&](size_t i) {
+                const InputSplit& split = splits[i];
+                MappedFile file(split.filename);
+                if (!file.is_open()) {
+                    std::cerr << "error: failed to open input file " << split.filename << std::endl;
+                    failed = true;
+                    return;
+                }
+                const auto task_start = Clock::now();
+                LocalTask task(true, this->num_reducers, 0, buffer_size, order, shuffle);
+                const std::string input(splitRecords(file.data(), split.offset, split.length));
+                {
+                    ScopedTimer timer(Counter::MAP_FUNCTION_NS);
+                    runLocalTask(task, [&] { this->mapper->map(*this, input); });
+                }
+                failed = failed || task.failed;
+                Metrics::add(Counter::MAP_TASKS, 1);
+                Metrics::add(Counter::MAP_INPUT_BYTES, input.size());
+                Metrics::add(Counter::MAP_OUTPUT_RECORDS, task.records);
+                Metrics::record(Histogram::MAP_TASK_US, elapsedUs(task_start));
+            });
+            if (failed) {
+                return false;
+            }
+            maps_completed = Clock::now();
+            std::cout << "Map phase completed in " << elapsedMs(start_time) << " ms, "
+                      << shuffle.spills() << " runs spilled" << std::endl;
+
+            pool.parallelFor(this->num_reducers, [&](size_t r) {
+                const auto task_start = Clock::now();
+                LocalTask task(false, 1, r, buffer_size, order, outputs);
+                size_t num_groups = 0;
+                size_t num_records = 0;
+                {
+                    ScopedTimer timer(Counter::REDUCE_FUNCTION_NS);
+                    runLocalTask(task, [&] {
+                        MergeIterator merge(shuffle.sources(r), order);
+                        groupByKey(merge, [&](std::string_view key, const std::vector<std::string_view>& values) {
+                            task.reduce_key = key;
+                            this->reducer->reduce(*this, std::string(key), std::vector<std::string>(values.begin(), values.end()));
+                            num_groups++;
+                            num_records += values.size();
+                        });
+                    });
+                }
+                shuffle.release(r);
+                failed = failed || task.failed;
+                Metrics::add(Counter::REDUCE_TASKS, 1);
+                Metrics::add(Counter::REDUCE_INPUT_GROUPS, num_groups);
+                Metrics::add(Counter::REDUCE_INPUT_RECORDS, num_records);
+                Metrics::add(Counter::REDUCE_OUTPUT_RECORDS, task.records);
+                Metrics::record(Histogram::REDUCE_TASK_US, elapsedUs(task_start));
+            });
+            if (failed) {
+                return false;
+            }
+            finished = Clock::now();
+            std::cout << "Reduce phase completed in " << elapsedMs(start_time) << " ms" << std::endl;
+
+            // Same as writeOutput, but the reduce outputs are read from memory
+            std::vector<std::unique_ptr<RecordSource>> sources;
+            for (size_t r = 0; r < this->num_reducers; r++) {
+                for (auto& source : outputs.sources(r)) {
+                    sources.push_back(std::move(source));
+                }
+            }
+            const bool concatenate = !this->sorted_output || !this->partition_boundaries.empty();
+            const std::string temp_filename = this->output_filename + ".tmp";
+            this->output_file.open(temp_filename, std::ios::binary | std::ios::trunc);
+            if (!this->output_file.is_open()) {
+                std::cerr << "error: failed to open output file " << temp_filename << std::endl;
+                return false;
+            }
+            if (!writeFinalOutput(std::move(sources), this->output_file, concatenate)) {
+                std::cerr << "error: failed to write output file " << this->output_filename << std::endl;
+                return false;
+            }
+            this->output_file.close();
+            std::filesystem::rename(temp_filename, this->output_filename);
+        } catch (const std::runtime_error& e) {
+            std::cerr << "error: local job failed: " << e.what() << std::endl;
+            return false;
+        }
+
+        std::cout << "MapReduce job has completed in " << elapsedMs(start_time) << " ms" << std::endl;
+        auto ms = [](Clock::time_point from, Clock::time_point to) -> uint64_t {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+        };
+        writeProfile("local", {
+            {"map_tasks", splits.size()},
+            {"reduce_tasks", this->num_reducers},
+            {"threads", num_threads},
+            {"wall_ms", ms(start_time, Clock::now())},
+            {"output_ms", ms(finished, Clock::now())},
+        }, ms(start_time, maps_completed), ms(maps_completed, finished), Metrics::snapshot().since(start_metrics));
+        return true;
+    }
 }
 
 #endif //MAPREDUCE_MAPREDUCE_HPP
@@ -0,0 +1,47 @@
+/*
+ * C ABI between the worker and the map/reduce functions of a user shared object.
+ *
+ * The worker looks up mr_map, mr_reduce and optionally mr_combine and mr_partition with
+ * dlsym(). Keys, values and inputs are passed as (pointer, length) pairs and are not
+ * NUL-terminated, so user code can emit slices of its input without copying them. Every
+ * function gets the opaque context of the task it runs in, which must be passed back to emit.
+ *
+ * The older map/reduce/combine/partition symbols that take NUL-terminated strings are still
+ * supported, and are used when the sized functions are not exported.
+ *
+ * C++ code can instead define a typed mapreduce::Job and export it with MAPREDUCE_EXPORT_JOB,
+ * see job.hpp. A C++ function may throw a std::exception to fail its task, which the worker
+ * reports to the coordinator so that the task runs again.
+ */
+
+#ifndef MAPREDUCE_ABI_H
+#define MAPREDUCE_ABI_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char* data;
+    size_t len;
+} mr_slice;
+
+/* Emit a key-value pair. The bytes are copied before emit returns. */
+typedef void (*mr_emit_t)(void* ctx, const char* key, size_t key_len, const char* value, size_t value_len);
+
+/* mr_map: called once per input split */
+typedef void (*mr_map_t)(void* ctx, const char* input, size_t input_len, mr_emit_t emit);
+
+/* mr_reduce and mr_combine: called once per key with all of its values */
+typedef void (*mr_reduce_t)(void* ctx, const char* key, size_t key_len, const mr_slice* values, size_t values_len, mr_emit_t emit);
+
+/* mr_partition: returns the partition in [0, num_partitions) of a key */
+typedef size_t (*mr_partition_t)(const char* key, size_t key_len, size_t num_partitions);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAPREDUCE_ABI_H */
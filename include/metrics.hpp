@@ -0,0 +1,291 @@
+//
+// Low-overhead counters and histograms of the work done by a process.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_METRICS_HPP
+#define MAPREDUCE_METRICS_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+namespace mapreduce {
+    enum class Counter : size_t {
+        MAP_TASKS,
+        MAP_INPUT_BYTES,
+        MAP_OUTPUT_RECORDS, // Emitted by the map function
+        MAP_WRITTEN_RECORDS, // Written to the intermediate files, after combining
+        MAP_FUNCTION_NS, // Mapping the input, including the spills of full sort buffers
+        SPILLS,
+        SPILLED_RECORDS,
+        SPILLED_BYTES,
+        SPILL_SORT_NS,
+        SPILL_WRITE_NS,
+        MAP_MERGE_NS, // Merging the spills into the intermediate files
+        REDUCE_TASKS,
+        SHUFFLE_FETCHES,
+        SHUFFLE_FETCHED_BYTES,
+        REDUCE_MERGE_NS, // Merging runs while the map tasks run
+        REDUCE_INPUT_RECORDS,
+        REDUCE_INPUT_GROUPS,
+        REDUCE_OUTPUT_RECORDS,
+        REDUCE_FUNCTION_NS, // Merging the runs and reducing them
+        COUNT
+    };
+
+    // Histograms of durations in microseconds
+    enum class Histogram : size_t {
+        MAP_TASK_US, // Attempts that completed, from assignment to completion
+        REDUCE_TASK_US,
+        MAP_QUEUE_WAIT_US, // From a task becoming idle to its assignment
+        REDUCE_QUEUE_WAIT_US,
+        RPC_ASSIGN_US, // Includes the time the coordinator holds the request until a task is ready
+        RPC_COMPLETE_US,
+        RPC_MAP_OUTPUTS_US,
+        RPC_HEARTBEAT_US,
+        SHUFFLE_FETCH_US,
+        COUNT
+    };
+
+    inline constexpr std::array<std::string_view, static_cast<size_t>(Counter::COUNT)> counter_names = {
+        "map_tasks", "map_input_bytes", "map_output_records", "map_written_records", "map_function_ns",
+        "spills", "spilled_records", "spilled_bytes", "spill_sort_ns", "spill_write_ns", "map_merge_ns",
+        "reduce_tasks", "shuffle_fetches", "shuffle_fetched_bytes", "reduce_merge_ns",
+        "reduce_input_records", "reduce_input_groups", "reduce_output_records", "reduce_function_ns",
+    };
+
+    inline constexpr std::array<std::string_view, static_cast<size_t>(Histogram::COUNT)> histogram_names = {
+        "map_task_us", "reduce_task_us", "map_queue_wait_us", "reduce_queue_wait_us",
+        "rpc_assign_us", "rpc_complete_us", "rpc_map_outputs_us", "rpc_heartbeat_us", "shuffle_fetch_us",
+    };
+
+    // Values of all the counters and histograms. Bucket 0 of a histogram counts the zeros, and
+    // bucket i > 0 the values in [2^(i - 1), 2^i).
+    struct MetricValues {
+        static constexpr size_t num_counters = static_cast<size_t>(Counter::COUNT);
+        static constexpr size_t num_histograms = static_cast<size_t>(Histogram::COUNT);
+        static constexpr size_t num_buckets = 48;
+
+        std::array<uint64_t, num_counters> counters{};
+        std::array<std::array<uint64_t, num_buckets>, num_histograms> buckets{};
+        std::array<uint64_t, num_histograms> sums{};
+
+        static size_t bucket(uint64_t value) {
+            return std::min<size_t>(std::bit_width(value), num_buckets - 1);
+        }
+
+        void merge(const MetricValues& other) {
+            for (size_t c = 0; c < num_counters; c++) {
+                this->counters[c] += other.counters[c];
+            }
+            for (size_t h = 0; h < num_histograms; h++) {
+                for (size_t b = 0; b < num_buckets; b++) {
+                    this->buckets[h][b] += other.buckets[h][b];
+                }
+                this->sums[h] += other.sums[h];
+            }
+        }
+
+        // Values accumulated since an earlier snapshot
+        MetricValues since(const MetricValues& earlier) const {
+            MetricValues delta;
+            for (size_t c = 0; c < num_counters; c++) {
+                delta.counters[c] = this->counters[c] - earlier.counters[c];
+            }
+            for (size_t h = 0; h < num_histograms; h++) {
+                for (size_t b = 0; b < num_buckets; b++) {
+                    delta.buckets[h][b] = this->buckets[h][b] - earlier.buckets[h][b];
+                }
+                delta.sums[h] = this->sums[h] - earlier.sums[h];
+            }
+            return delta;
+        }
+
+        uint64_t counter(Counter c) const {
+            return this->counters[static_cast<size_t>(c)];
+        }
+
+        uint64_t count(Histogram h) const {
+            uint64_t count = 0;
+            for (uint64_t n : this->buckets[static_cast<size_t>(h)]) {
+                count += n;
+            }
+            return count;
+        }
+
+        // Upper bound of the bucket holding the given quantile, 0 if the histogram is empty
+        uint64_t quantile(Histogram h, double q) const {
+            const auto& buckets = this->buckets[static_cast<size_t>(h)];
+            const uint64_t n = count(h);
+            const uint64_t rank = std::min(static_cast<uint64_t>(q * n), n > 0 ? n - 1 : 0);
+            uint64_t seen = 0;
+            for (size_t b = 0; b < num_buckets; b++) {
+                seen += buckets[b];
+                if (buckets[b] > 0 && seen > rank) {
+                    return b == 0 ? 0 : (uint64_t(1) << b) - 1;
+                }
+            }
+            return 0;
+        }
+
+        // Write the counters and the summaries of the non-empty histograms as the members
+        // "counters" and "histograms" of a JSON object
+        void writeJson(std::ostream& out, std::string_view indent) const {
+            out << indent << "\"counters\": {";
+            for (size_t c = 0; c < num_counters; c++) {
+                out << (c > 0 ? "," : "") << "\n" << indent << "  \"" << counter_names[c] << "\": " << this->counters[c];
+            }
+            out << "\n" << indent << "},\n" << indent << "\"histograms\": {";
+            bool first = true;
+            for (size_t h = 0; h < num_histograms; h++) {
+                const auto histogram = static_cast<Histogram>(h);
+                const uint64_t n = count(histogram);
+                if (n == 0) {
+                    continue;
+                }
+                out << (first ? "" : ",") << "\n" << indent << "  \"" << histogram_names[h] << "\": {"
+                    << "\"count\": " << n << ", \"sum\": " << this->sums[h] << ", \"mean\": " << this->sums[h] / n
+                    << ", \"p50\": " << quantile(histogram, 0.5) << ", \"p90\": " << quantile(histogram, 0.9)
+                    << ", \"p99\": " << quantile(histogram, 0.99) << ", \"max\": " << quantile(histogram, 1.0) << "}";
+                first = false;
+            }
+            out << "\n" << indent << "}";
+        }
+    };
+
+    // The metrics of the process. Every thread accumulates into a block of its own, which only
+    // it writes, so recording a value is a couple of uncontended relaxed atomic operations. A
+    // snapshot sums the blocks of the live threads and what exited threads left behind.
+    class Metrics {
+    public:
+        static void add(Counter counter, uint64_t n) {
+            auto& value = local().counters[static_cast<size_t>(counter)];
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        static void record(Histogram histogram, uint64_t value) {
+            Block& block = local();
+            const size_t h = static_cast<size_t>(histogram);
+            auto& bucket = block.buckets[h][MetricValues::bucket(value)];
+            bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            block.sums[h].store(block.sums[h].load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        static MetricValues snapshot() {
+            Registry& registry = Registry::instance();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            MetricValues values = registry.exited;
+            for (const Block* block : registry.blocks) {
+                values.merge(block->load());
+            }
+            return values;
+        }
+
+    private:
+        struct Block {
+            std::array<std::atomic<uint64_t>, MetricValues::num_counters> counters{};
+            std::array<std::array<std::atomic<uint64_t>, MetricValues::num_buckets>, MetricValues::num_histograms> buckets{};
+            std::array<std::atomic<uint64_t>, MetricValues::num_histograms> sums{};
+
+            MetricValues load() const {
+                MetricValues values;
+                for (size_t c = 0; c < MetricValues::num_counters; c++) {
+                    values.counters[c] = this->counters[c].load(std::memory_order_relaxed);
+                }
+                for (size_t h = 0; h < MetricValues::num_histograms; h++) {
+                    for (size_t b = 0; b < MetricValues::num_buckets; b++) {
+                        values.buckets[h][b] = this->buckets[h][b].load(std::memory_order_relaxed);
+                    }
+                    values.sums[h] = this->sums[h].load(std::memory_order_relaxed);
+                }
+                return values;
+            }
+        };
+
+        struct Registry {
+            std::mutex mutex;
+            std::vector<const Block*> blocks;
+            MetricValues exited;
+
+            static Registry& instance() {
+                static Registry registry;
+                return registry;
+            }
+        };
+
+        // Registers the block of a thread on its first use, and folds it into the totals when
+        // the thread exits
+        struct Registration {
+            Block block;
+
+            Registration() {
+                Registry& registry = Registry::instance();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.blocks.push_back(&this->block);
+            }
+
+            ~Registration() {
+                Registry& registry = Registry::instance();
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                registry.exited.merge(this->block.load());
+                std::erase(registry.blocks, &this->block);
+            }
+        };
+
+        static Block& local() {
+            thread_local Registration registration;
+            return registration.block;
+        }
+    };
+
+    // Adds the time from its construction to its destruction to a counter, in nanoseconds
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Counter counter) : counter(counter), start(std::chrono::steady_clock::now()) { }
+
+        ~ScopedTimer() {
+            Metrics::add(this->counter, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - this->start).count());
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        Counter counter;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // Write a JSON string. Quotes, backslashes and bytes outside of printable ASCII are escaped,
+    // the latter as \u00XX, so binary keys are written as if they were Latin-1.
+    inline void writeJsonString(std::ostream& out, std::string_view s) {
+        static constexpr char hex[] = "0123456789abcdef";
+        out << '"';
+        for (unsigned char c : s) {
+            if (c == '"' || c == '\\') {
+                out << '\\' << c;
+            } else if (c < 0x20 || c >= 0x7f) {
+                out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+            } else {
+                out << c;
+            }
+        }
+        out << '"';
+    }
+
+    // Microseconds since a time point, for the histograms
+    inline uint64_t elapsedUs(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+#endif //MAPREDUCE_METRICS_HPP
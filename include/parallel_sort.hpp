@@ -0,0 +1,67 @@
+//
+// Parallel merge sort on a thread pool.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_PARALLEL_SORT_HPP
+#define MAPREDUCE_PARALLEL_SORT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "thread_pool.hpp"
+
+namespace mapreduce {
+    // Sort the items with less. The items are cut into one range per thread of the pool, the
+    // ranges are sorted in parallel, and then merged pairwise in parallel, alternating between
+    // the items and a scratch vector. Small inputs, or a null pool, use std::sort.
+    template <typename T, typename Less>
+    void parallelSort(ThreadPool* pool, std::vector<T>& items, Less less, size_t min_parallel_size = 64 * 1024) {
+        if (!pool || pool->size() < 2 || items.size() < min_parallel_size) {
+            std::sort(items.begin(), items.end(), less);
+            return;
+        }
+
+        // Bounds of the sorted ranges, range i is [bounds[i], bounds[i + 1])
+        const size_t num_ranges = pool->size();
+        std::vector<size_t> bounds;
+        for (size_t i = 0; i <= num_ranges; i++) {
+            bounds.push_back(items.size() * i / num_ranges);
+        }
+        pool->parallelFor(num_ranges, [&](size_t i) {
+            std::sort(items.begin() + bounds[i], items.begin() + bounds[i + 1], less);
+        });
+
+        std::vector<T> scratch(items.size());
+        std::vector<T>* from = &items;
+        std::vector<T>* to = &scratch;
+        while (bounds.size() > 2) {
+            // Merge ranges 2i and 2i + 1, an odd range out is copied as is
+            const size_t num_pairs = bounds.size() / 2;
+            pool->parallelFor(num_pairs, [&](size_t i) {
+                const size_t begin = bounds[2 * i];
+                const size_t middle = bounds[std::min(2 * i + 1, bounds.size() - 1)];
+                const size_t end = bounds[std::min(2 * i + 2, bounds.size() - 1)];
+                std::merge(from->begin() + begin, from->begin() + middle, from->begin() + middle, from->begin() + end,
+                           to->begin() + begin, less);
+            });
+
+            std::vector<size_t> merged_bounds;
+            for (size_t i = 0; i < bounds.size(); i += 2) {
+                merged_bounds.push_back(bounds[i]);
+            }
+            if (merged_bounds.back() != bounds.back()) {
+                merged_bounds.push_back(bounds.back());
+            }
+            bounds = std::move(merged_bounds);
+            std::swap(from, to);
+        }
+
+        if (from != &items) {
+            items.swap(scratch);
+        }
+    }
+}
+
+#endif //MAPREDUCE_PARALLEL_SORT_HPP
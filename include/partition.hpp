@@ -0,0 +1,42 @@
+//
+// Partitioning of intermediate keys across reduce tasks.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_PARTITION_HPP
+#define MAPREDUCE_PARTITION_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mapreduce {
+    // 64-bit FNV-1a hash of a key. Unlike std::hash, the result is stable across builds,
+    // so every worker agrees on which partition a key belongs to.
+    inline uint64_t hashKey(std::string_view key) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            hash ^= c;
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Default partition function: hash(key) mod num_partitions
+    inline size_t defaultPartition(std::string_view key, size_t num_partitions) {
+        return hashKey(key) % num_partitions;
+    }
+
+    // Range partition function: partition i holds the keys in [boundaries[i - 1], boundaries[i]),
+    // so the sorted partitions are also sorted with respect to each other. The boundaries must
+    // be sorted, there is one partition more than there are boundaries.
+    inline size_t rangePartition(std::string_view key, const std::vector<std::string>& boundaries) {
+        return std::upper_bound(boundaries.begin(), boundaries.end(), key) - boundaries.begin();
+    }
+}
+
+#endif //MAPREDUCE_PARTITION_HPP
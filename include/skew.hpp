@@ -0,0 +1,116 @@
+//
+// Detection of the partitions and keys that hold a disproportionate share of the map output.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_SKEW_HPP
+#define MAPREDUCE_SKEW_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace mapreduce {
+    // Space-Saving sketch of the most frequent keys of a stream, in bounded memory. Every key
+    // whose count is above total / capacity is guaranteed to be tracked, and the count of a
+    // tracked key overestimates its true count by at most the smallest tracked count.
+    class HeavyHitters {
+    public:
+        struct Entry {
+            std::string key;
+            uint64_t count;
+            uint32_t partition;
+        };
+
+        explicit HeavyHitters(size_t capacity = 64) : capacity(std::max<size_t>(capacity, 1)) { }
+
+        void add(std::string_view key, uint32_t partition, uint64_t count = 1) {
+            // Keys are only copied when they start being tracked
+            auto it = this->counts.find(key);
+            if (it != this->counts.end()) {
+                it->second.count += count;
+                return;
+            }
+            if (this->counts.size() < this->capacity) {
+                this->counts.emplace(std::string(key), Counted{count, partition});
+                return;
+            }
+            // Replace the least frequent key, the new key inherits its count. Its node is reused,
+            // so that the key's string and the node are not allocated again.
+            auto min = std::min_element(this->counts.begin(), this->counts.end(), [](const auto& a, const auto& b) {
+                return a.second.count < b.second.count;
+            });
+            auto node = this->counts.extract(min);
+            node.key().assign(key);
+            node.mapped() = Counted{node.mapped().count + count, partition};
+            this->counts.insert(std::move(node));
+        }
+
+        void merge(const HeavyHitters& other) {
+            for (const auto& [key, counted] : other.counts) {
+                add(key, counted.partition, counted.count);
+            }
+        }
+
+        // The n most frequent keys, most frequent first
+        std::vector<Entry> top(size_t n) const {
+            std::vector<Entry> entries;
+            for (const auto& [key, counted] : this->counts) {
+                entries.push_back({key, counted.count, counted.partition});
+            }
+            std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+                return a.count != b.count ? a.count > b.count : a.key < b.key;
+            });
+            entries.resize(std::min(n, entries.size()));
+            return entries;
+        }
+
+    private:
+        struct Counted {
+            uint64_t count;
+            uint32_t partition;
+        };
+
+        // Lets the map be searched by std::string_view
+        struct Hash {
+            using is_transparent = void;
+
+            size_t operator()(std::string_view key) const {
+                return std::hash<std::string_view>{}(key);
+            }
+        };
+
+        size_t capacity;
+        std::unordered_map<std::string, Counted, Hash, std::equal_to<>> counts;
+    };
+
+    // Number of tasks each partition should be split across so that none is much larger than
+    // the average: a partition larger than threshold times the average size is split into
+    // shares of about the average size, at most max_splits of them. Partitions that are not
+    // split get 1.
+    inline std::vector<size_t> planPartitionSplits(const std::vector<uint64_t>& sizes, double threshold, size_t max_splits) {
+        std::vector<size_t> splits(sizes.size(), 1);
+        uint64_t total = 0;
+        for (uint64_t size : sizes) {
+            total += size;
+        }
+        if (sizes.empty() || total == 0 || threshold <= 0) {
+            return splits;
+        }
+        const double mean = static_cast<double>(total) / sizes.size();
+        for (size_t p = 0; p < sizes.size(); p++) {
+            if (sizes[p] > threshold * mean) {
+                splits[p] = std::clamp<size_t>(static_cast<size_t>(std::ceil(sizes[p] / mean)), 1, std::max<size_t>(max_splits, 1));
+            }
+        }
+        return splits;
+    }
+}
+
+#endif //MAPREDUCE_SKEW_HPP
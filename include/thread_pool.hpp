@@ -0,0 +1,187 @@
+//
+// Work-stealing thread pool for running the pieces of a task in parallel.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_THREAD_POOL_HPP
+#define MAPREDUCE_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mapreduce {
+    // A fixed set of threads, each with its own queue of jobs. A thread runs the jobs of its own
+    // queue newest first, and once it is empty steals the oldest jobs of the other queues, so
+    // uneven jobs are balanced without a single contended queue.
+    //
+    // parallelFor() may be called from several threads at once, and from inside a job. The
+    // calling thread runs queued jobs while it waits, so nested calls can't deadlock.
+    class ThreadPool {
+    public:
+        explicit ThreadPool(size_t num_threads) {
+            num_threads = std::max<size_t>(num_threads, 1);
+            for (size_t i = 0; i < num_threads; i++) {
+                this->queues.push_back(std::make_unique<Queue>());
+            }
+            for (size_t i = 0; i < num_threads; i++) {
+                this->threads.emplace_back([this, i] { workerLoop(i); });
+            }
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->stopping = true;
+            }
+            this->job_available.notify_all();
+            for (auto& thread : this->threads) {
+                thread.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t size() const {
+            return this->threads.size();
+        }
+
+        // Queue a job. Jobs submitted from a pool thread go to its own queue.
+        void submit(std::function<void()> job) {
+            size_t queue = this == current_pool ? current_index : this->next_queue++ % this->queues.size();
+            // Counted before it is published, so that a thread that takes the job right away
+            // never decrements the count below zero
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->num_queued++;
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->queues[queue]->mutex);
+                this->queues[queue]->jobs.push_back(std::move(job));
+            }
+            this->job_available.notify_one();
+        }
+
+        // Call func(i) for every i in [0, n) on the pool, and return once all calls have
+        // returned. The first exception thrown by func is rethrown.
+        template <typename Func>
+        void parallelFor(size_t n, Func func) {
+            if (n == 0) {
+                return;
+            }
+
+            struct Batch {
+                std::atomic<size_t> remaining;
+                std::mutex mutex;
+                std::condition_variable done;
+                std::exception_ptr error;
+            };
+            auto batch = std::make_shared<Batch>();
+            batch->remaining = n;
+
+            for (size_t i = 0; i < n; i++) {
+                submit([batch, &func, i] {
+                    try {
+                        func(i);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(batch->mutex);
+                        if (!batch->error) {
+                            batch->error = std::current_exception();
+                        }
+                    }
+                    if (--batch->remaining == 0) {
+                        std::lock_guard<std::mutex> lock(batch->mutex);
+                        batch->done.notify_all();
+                    }
+                });
+            }
+
+            // Help out until the queues are empty, then wait for the jobs other threads are running
+            const size_t self = this == current_pool ? current_index : 0;
+            while (batch->remaining > 0 && runOne(self)) { }
+            {
+                std::unique_lock<std::mutex> lock(batch->mutex);
+                batch->done.wait(lock, [&] { return batch->remaining == 0; });
+            }
+            if (batch->error) {
+                std::rethrow_exception(batch->error);
+            }
+        }
+
+    private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<std::function<void()>> jobs;
+        };
+
+        // Run one job, from the back of queue self or else stolen from the front of another
+        // queue. Returns false if every queue is empty.
+        bool runOne(size_t self) {
+            std::function<void()> job;
+            for (size_t i = 0; i < this->queues.size() && !job; i++) {
+                Queue& queue = *this->queues[(self + i) % this->queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.jobs.empty()) {
+                    continue;
+                }
+                if (i == 0) {
+                    job = std::move(queue.jobs.back());
+                    queue.jobs.pop_back();
+                } else {
+                    job = std::move(queue.jobs.front());
+                    queue.jobs.pop_front();
+                }
+            }
+            if (!job) {
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->num_queued--;
+            }
+            job();
+            return true;
+        }
+
+        void workerLoop(size_t index) {
+            current_pool = this;
+            current_index = index;
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(this->mutex);
+                    this->job_available.wait(lock, [this] { return this->stopping || this->num_queued > 0; });
+                    if (this->num_queued == 0) {
+                        return; // Stopping, and every job has run
+                    }
+                }
+                runOne(index);
+            }
+        }
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+        std::atomic<size_t> next_queue = 0;
+
+        // Number of jobs in the queues, the idle threads sleep until it is non-zero
+        std::mutex mutex;
+        std::condition_variable job_available;
+        size_t num_queued = 0;
+        bool stopping = false;
+
+        // The pool and queue of the calling thread, if it is a pool thread
+        static inline thread_local ThreadPool* current_pool = nullptr;
+        static inline thread_local size_t current_index = 0;
+    };
+}
+
+#endif //MAPREDUCE_THREAD_POOL_HPP
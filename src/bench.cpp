@@ -0,0 +1,335 @@
+// End-to-end benchmark of a MapReduce job. Generates a deterministic word-count dataset, runs the
+// coordinator and N workers on it, and prints the timings as JSON, see performance-analysis.md.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../include/journal.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Parameters of the generated input. The same parameters always generate the same files.
+struct Dataset {
+    size_t num_files = 4;
+    size_t file_size = 8 * 1024 * 1024;
+    size_t num_keys = 100000; // Number of distinct words
+    double zipf = 1.0; // Exponent of the Zipf distribution of the words, 0 is uniform
+    uint64_t seed = 1;
+    // Filled in by generate_dataset()
+    size_t input_bytes = 0;
+    size_t num_words = 0;
+};
+
+// std::mt19937_64 produces the same sequence everywhere, unlike the standard distributions,
+// so the words are drawn from it directly
+double next_unit(std::mt19937_64& rng) {
+    return (rng() >> 11) * 0x1.0p-53;
+}
+
+// Distinct lowercase words of 3 to 10 letters
+std::vector<std::string> make_vocabulary(size_t num_keys, std::mt19937_64& rng) {
+    std::vector<std::string> words;
+    std::unordered_set<std::string> seen;
+    while (words.size() < num_keys) {
+        std::string word(3 + rng() % 8, 'a');
+        for (auto& c : word) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+        if (seen.insert(word).second) {
+            words.push_back(std::move(word));
+        }
+    }
+    return words;
+}
+
+// Write the input files into input_dir, 16 words per line. Returns false if a file could not be written.
+bool generate_dataset(Dataset& dataset, const std::filesystem::path& input_dir) {
+    std::mt19937_64 rng(dataset.seed);
+    const std::vector<std::string> words = make_vocabulary(dataset.num_keys, rng);
+
+    // Word i is drawn with a probability proportional to 1 / (i + 1)^zipf
+    std::vector<double> cdf(words.size());
+    double total = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        total += 1.0 / std::pow(static_cast<double>(i + 1), dataset.zipf);
+        cdf[i] = total;
+    }
+    for (auto& p : cdf) {
+        p /= total;
+    }
+
+    std::filesystem::create_directories(input_dir);
+    dataset.input_bytes = 0;
+    dataset.num_words = 0;
+    std::string buffer;
+    for (size_t f = 0; f < dataset.num_files; f++) {
+        std::ofstream file(input_dir / ("words-" + std::to_string(f) + ".txt"), std::ios::binary | std::ios::trunc);
+        size_t size = 0;
+        size_t words_on_line = 0;
+        buffer.clear();
+        while (size + buffer.size() < dataset.file_size) {
+            size_t i = std::upper_bound(cdf.begin(), cdf.end(), next_unit(rng)) - cdf.begin();
+            buffer.append(words[std::min(i, words.size() - 1)]);
+            buffer.push_back(++words_on_line % 16 == 0 ? '\n' : ' ');
+            dataset.num_words++;
+            if (buffer.size() >= 1024 * 1024) {
+                file.write(buffer.data(), buffer.size());
+                size += buffer.size();
+                buffer.clear();
+            }
+        }
+        file.write(buffer.data(), buffer.size());
+        size += buffer.size();
+        dataset.input_bytes += size;
+        if (!file) {
+            std::cerr << "Failed to write the input files in " << input_dir << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Start a program with its output redirected to log_filename
+pid_t spawn(const std::vector<std::string>& args, const std::string& log_filename) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    int log = open(log_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    std::cerr << "execv() failed for " << args[0] << ": " << strerror(errno) << std::endl;
+    _exit(127);
+}
+
+// Time at which each phase of the job ended, read from the coordinator's journal
+struct Phases {
+    Clock::time_point maps_done;
+    Clock::time_point reduces_done;
+    Clock::time_point output_done;
+    bool has_maps = false, has_reduces = false, has_output = false;
+};
+
+void update_phases(const std::string& journal_filename, Phases& phases) {
+    const auto records = mapreduce::JobJournal::read(journal_filename);
+    if (records.empty() || records[0].size() != 3) {
+        return;
+    }
+    const size_t num_maps = std::stoul(records[0][1]);
+    const size_t num_reduces = std::stoul(records[0][2]);
+    size_t maps = 0, reduces = 0;
+    bool output = false;
+    for (const auto& record : records) {
+        if (record.size() >= 2 && record[1] == "map") {
+            if (record[0] == "complete") {
+                maps++;
+            } else {
+                maps--; // Lost, and running again
+            }
+        } else if (record.size() >= 2 && record[1] == "reduce") {
+            reduces++;
+        } else if (record.size() == 2 && record[1] == "output") {
+            output = true;
+        }
+    }
+
+    const auto now = Clock::now();
+    if (!phases.has_maps && maps == num_maps) {
+        phases.maps_done = now;
+        phases.has_maps = true;
+    }
+    if (!phases.has_reduces && reduces == num_reduces) {
+        phases.reduces_done = now;
+        phases.has_reduces = true;
+    }
+    if (!phases.has_output && output) {
+        phases.output_done = now;
+        phases.has_output = true;
+    }
+}
+
+// Size of the intermediate files of the winning map attempts, which is what the reduce tasks read
+size_t bytes_shuffled(const std::string& journal_filename) {
+    const auto records = mapreduce::JobJournal::read(journal_filename);
+    if (records.empty() || records[0].size() != 3) {
+        return 0;
+    }
+    const size_t num_reduces = std::stoul(records[0][2]);
+    std::map<std::string, std::string> outputs; // Map task id to its latest output
+    for (const auto& record : records) {
+        if (record.size() >= 4 && record[0] == "complete" && record[1] == "map") {
+            outputs[record[2]] = record[3];
+        }
+    }
+    size_t bytes = 0;
+    for (const auto& [id, prefix] : outputs) {
+        for (size_t r = 0; r < num_reduces; r++) {
+            std::error_code error;
+            size_t size = std::filesystem::file_size(prefix + "-" + std::to_string(r), error);
+            bytes += error ? 0 : size;
+        }
+    }
+    return bytes;
+}
+
+double seconds(Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+int main(int argc, char** argv) {
+    // Options are --name value pairs
+    std::map<std::string, std::string> options = {
+        {"files", "4"}, {"file-size", std::to_string(8 * 1024 * 1024)}, {"keys", "100000"}, {"zipf", "1.0"},
+        {"seed", "1"}, {"workers", "4"}, {"mappers", "4"}, {"reducers", "4"}, {"worker-args", ""},
+        {"dir", "bench-run"}, {"bin", std::filesystem::canonical("/proc/self/exe").parent_path().string()},
+        {"so", ""}, {"timeout", "600"}, {"output", ""},
+    };
+    for (int i = 1; i < argc; i++) {
+        std::string name = argv[i];
+        if (!name.starts_with("--") || !options.contains(name.substr(2)) || i + 1 >= argc) {
+            std::cerr << "Usage: " << argv[0] << " [--files N] [--file-size BYTES] [--keys N] [--zipf S] [--seed N]"
+                      << " [--workers N] [--mappers N] [--reducers N] [--worker-args \"SLOTS MAP_THREADS ...\"]"
+                      << " [--dir DIR] [--bin DIR] [--so FILE] [--timeout SECONDS] [--output FILE]" << std::endl;
+            return 1;
+        }
+        options[name.substr(2)] = argv[++i];
+    }
+    const std::filesystem::path bin = std::filesystem::absolute(options["bin"]);
+    const std::string so_filename = options["so"].empty() ? (bin / "wc.so").string() : std::filesystem::absolute(options["so"]).string();
+
+    Dataset dataset;
+    dataset.num_files = std::stoul(options["files"]);
+    dataset.file_size = std::stoul(options["file-size"]);
+    dataset.num_keys = std::max<size_t>(std::stoul(options["keys"]), 1);
+    dataset.zipf = std::stod(options["zipf"]);
+    dataset.seed = std::stoull(options["seed"]);
+
+    // Everything runs in the benchmark directory. The files of a previous run are removed first.
+    const std::filesystem::path original_dir = std::filesystem::current_path();
+    const std::filesystem::path dir = options["dir"];
+    std::filesystem::create_directories(dir);
+    std::filesystem::current_path(dir);
+    for (const auto& entry : std::filesystem::directory_iterator(".")) {
+        const std::string name = entry.path().filename().string();
+        if (name == "input" || name == "logs" || name.starts_with("mr-") || name.starts_with("output.txt")) {
+            std::filesystem::remove_all(entry.path());
+        }
+    }
+    std::filesystem::create_directories("logs");
+
+    std::cerr << "Generating " << dataset.num_files << " files of " << dataset.file_size << " bytes" << std::endl;
+    if (!generate_dataset(dataset, "input")) {
+        return 1;
+    }
+
+    const std::string output_filename = "output.txt";
+    const std::string journal_filename = output_filename + ".journal";
+    const size_t num_workers = std::stoul(options["workers"]);
+    std::vector<std::string> worker_args;
+    std::istringstream worker_options(options["worker-args"]);
+    for (std::string arg; worker_options >> arg; ) {
+        worker_args.push_back(arg);
+    }
+
+    std::cerr << "Running the coordinator and " << num_workers << " workers" << std::endl;
+    const auto start = Clock::now();
+    pid_t coordinator = spawn({(bin / "coordinator").string(), "input", output_filename, "0.0.0.0:8995",
+                               options["mappers"], options["reducers"]}, "logs/coordinator.log");
+    std::vector<pid_t> workers;
+    for (size_t i = 0; i < num_workers; i++) {
+        std::vector<std::string> args = {(bin / "worker").string(), "w" + std::to_string(i), so_filename};
+        args.insert(args.end(), worker_args.begin(), worker_args.end());
+        workers.push_back(spawn(args, "logs/worker-" + std::to_string(i) + ".log"));
+    }
+
+    // Poll the journal for the end of each phase until the coordinator exits
+    Phases phases;
+    int status = 0;
+    struct rusage usage = {};
+    const auto deadline = start + std::chrono::seconds(std::stoul(options["timeout"]));
+    bool timed_out = false;
+    while (wait4(coordinator, &status, WNOHANG, &usage) == 0) {
+        update_phases(journal_filename, phases);
+        if (Clock::now() > deadline) {
+            timed_out = true;
+            kill(coordinator, SIGKILL);
+            for (pid_t worker : workers) {
+                kill(worker, SIGKILL);
+            }
+            wait4(coordinator, &status, 0, &usage);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const auto end = Clock::now();
+    update_phases(journal_filename, phases);
+    const long coordinator_rss = usage.ru_maxrss;
+    bool ok = !timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0 && phases.has_output;
+
+    long worker_rss = 0;
+    for (pid_t worker : workers) {
+        int worker_status = 0;
+        struct rusage worker_usage = {};
+        wait4(worker, &worker_status, 0, &worker_usage);
+        worker_rss = std::max(worker_rss, worker_usage.ru_maxrss);
+        ok = ok && WIFEXITED(worker_status) && WEXITSTATUS(worker_status) == 0;
+    }
+    struct rusage children = {};
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    const double elapsed = seconds(end - start);
+    auto phase = [&](bool has_end, Clock::time_point phase_end, Clock::time_point phase_start) {
+        return has_end ? seconds(phase_end - phase_start) : -1.0;
+    };
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(3);
+    json << "{\n"
+         << "  \"ok\": " << (ok ? "true" : "false") << ",\n"
+         << "  \"dataset\": {\"files\": " << dataset.num_files << ", \"file_size\": " << dataset.file_size
+         << ", \"keys\": " << dataset.num_keys << ", \"zipf\": " << dataset.zipf << ", \"seed\": " << dataset.seed
+         << ", \"input_bytes\": " << dataset.input_bytes << ", \"words\": " << dataset.num_words << "},\n"
+         << "  \"config\": {\"workers\": " << num_workers << ", \"mappers\": " << options["mappers"]
+         << ", \"reducers\": " << options["reducers"] << ", \"worker_args\": \"" << options["worker-args"] << "\"},\n"
+         << "  \"elapsed_s\": " << elapsed << ",\n"
+         // Reduce tasks start before the last map task completes, so the phases are measured
+         // from the start of the job to the end of each phase
+         << "  \"phase_end_s\": {\"map\": " << phase(phases.has_maps, phases.maps_done, start)
+         << ", \"reduce\": " << phase(phases.has_reduces, phases.reduces_done, start)
+         << ", \"output\": " << phase(phases.has_output, phases.output_done, start) << "},\n"
+         << "  \"throughput\": {\"input_mb_per_s\": " << dataset.input_bytes / 1e6 / elapsed
+         << ", \"words_per_s\": " << dataset.num_words / elapsed << "},\n"
+         << "  \"bytes_shuffled\": " << bytes_shuffled(journal_filename) << ",\n"
+         << "  \"peak_rss_kb\": {\"coordinator\": " << coordinator_rss << ", \"worker_max\": " << worker_rss
+         << ", \"children_max\": " << children.ru_maxrss << "}\n"
+         << "}\n";
+
+    std::cout << json.str();
+    if (!options["output"].empty()) {
+        std::ofstream(original_dir / options["output"]) << json.str();
+    }
+    return ok ? 0 : 1;
+}
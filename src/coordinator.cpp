@@ -1,11 +1,29 @@
 #include "../include/mapreduce.hpp"
 #include <chrono>
+#include <cstdlib>
 
 int main(int argc, char** argv) {
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " <input_dir> <output_file> <server_address> <num_mappers> <num_reducers>" << std::endl;
+    const std::string usage = std::string("Usage: ") + argv[0]
+        + " <input_dir> <output_file> <server_address> <num_mappers> <num_reducers> [--resume] [--cache <cache_dir> <map_reduce_functions.so>]";
+    if (argc < 6) {
+        std::cerr << usage << std::endl;
         return 1;
     }
+    bool resume = false;
+    std::string cache_dir;
+    std::string so_filename;
+    for (int i = 6; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--resume") {
+            resume = true;
+        } else if (option == "--cache" && i + 2 < argc) {
+            cache_dir = argv[++i];
+            so_filename = argv[++i];
+        } else {
+            std::cerr << usage << std::endl;
+            return 1;
+        }
+    }
     
     std::string input_dir = argv[1];
     std::string output_file = argv[2];
@@ -18,9 +36,18 @@ int main(int argc, char** argv) {
     mapreduce::MapReduceSpec spec;
     spec.input_dir_name = input_dir;
     spec.output_filename = output_file;
+    spec.server_address = server_address;
     spec.num_mappers = num_mappers;
     spec.num_reducers = num_reducers;
     spec.max_segment_size = max_segment_size;
+    // Skip the tasks that completed before the coordinator was stopped, see <output_file>.journal
+    spec.resume = resume;
+    // Reuse the map outputs of the splits that didn't change since the previous run, the shared
+    // object is hashed so that a new version of the map function invalidates them
+    spec.cache_dir = cache_dir;
+    spec.so_filename = so_filename;
+    // Log every request, like the workers
+    spec.verbose = std::getenv("MAPREDUCE_VERBOSE") != nullptr;
     
     auto start = std::chrono::high_resolution_clock::now();
 
@@ -1,22 +1,70 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <chrono>
 #include <thread>
 #include <unordered_map>
+#include <cstring>
+#include <filesystem>
+#include <deque>
+#include <functional>
+#include <unordered_set>
+#include <cstdlib>
 #include <dlfcn.h>
+#include <unistd.h>
 #include <grpcpp/grpcpp.h>
 #include "coordinator.grpc.pb.h"
+#include "../include/mapreduce_abi.h"
+#include "../include/partition.hpp"
+#include "../include/intermediate.hpp"
+#include "../include/final_output.hpp"
+#include "../include/map_output_buffer.hpp"
+#include "../include/input_split.hpp"
+#include "../include/mapped_file.hpp"
+#include "../include/metrics.hpp"
+#include "../include/skew.hpp"
+#include "../include/thread_pool.hpp"
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReader;
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::ServerContext;
+using grpc::ServerWriter;
 using grpc::Status;
 using coordinator::Coordinator;
 using coordinator::AssignRequest;
 using coordinator::AssignReply;
 using coordinator::CompleteRequest;
 using coordinator::CompleteReply;
+using coordinator::MapOutputsRequest;
+using coordinator::MapOutputsReply;
+using coordinator::LostMapOutput;
+using coordinator::HeartbeatRequest;
+using coordinator::HeartbeatReply;
+using coordinator::Shuffle;
+using coordinator::FetchPartitionRequest;
+using coordinator::PartitionChunk;
+using mapreduce::Metrics;
+using mapreduce::Counter;
+using mapreduce::Histogram;
+
+// Log every RPC, set with the MAPREDUCE_VERBOSE environment variable
+const bool verbose = std::getenv("MAPREDUCE_VERBOSE") != nullptr;
+
+// Size of every partition of a map task's output and its most frequent keys, reported to the
+// coordinator so that it can split the partitions that are much larger than the others
+struct MapOutputStats {
+    std::vector<uint64_t> partition_records;
+    std::vector<uint64_t> partition_bytes;
+    std::vector<mapreduce::HeavyHitters::Entry> heavy_hitters;
+    bool has_combine = false;
+};
 
 class CoordinatorClient {
     public:
@@ -24,7 +72,7 @@ class CoordinatorClient {
         // Empty
     }
     
-    AssignReply Assign(std::string worker_id) {
+    AssignReply Assign(std::string worker_id, std::string host, const std::function<std::vector<std::string>()>& cached_inputs) {
         int retries = 1;
         const int max_retries = 15;
         while (true) {
@@ -33,10 +81,23 @@ class CoordinatorClient {
             ClientContext context;
             
             request.set_worker_id(worker_id);
+            request.set_host(host);
+            for (const auto& filename : cached_inputs()) {
+                request.add_cached_input(filename);
+            }
 
-            std::cout << "Sending Assign RPC to the coordinator" << std::endl;
+            if (verbose) {
+                std::cout << "Sending Assign RPC to the coordinator" << std::endl;
+            }
+            const auto sent = std::chrono::steady_clock::now();
             Status status = stub_->Assign(&context, request, &reply);
+            Metrics::record(Histogram::RPC_ASSIGN_US, mapreduce::elapsedUs(sent));
             if (status.ok()) {
+                // The coordinator already waited for a task to become available, so ask again
+                // right away
+                if (reply.taskname() == "wait") {
+                    continue;
+                }
                 return reply;
             } else {
                 std::cout << "Assign RPC failed: " << status.error_code() << ": " << status.error_message() << std::endl;
@@ -50,16 +111,50 @@ class CoordinatorClient {
         }
     }
     
-    CompleteReply Complete(std::string worker_id, std::string taskname, std::string output_filename) {
+    CompleteReply Complete(std::string worker_id, std::string taskname, uint32_t task_id, uint32_t attempt_id, std::string output_filename,
+                           std::string shuffle_address, const mapreduce::MetricValues& metrics, const MapOutputStats& stats,
+                           bool failed = false) {
         CompleteRequest request;
         CompleteReply reply;
         ClientContext context;
         
         request.set_worker_id(worker_id);
         request.set_taskname(taskname);
+        request.set_task_id(task_id);
+        request.set_attempt_id(attempt_id);
         request.set_output_filename(output_filename);
+        request.set_shuffle_address(shuffle_address);
+        for (size_t c = 0; c < metrics.num_counters; c++) {
+            if (metrics.counters[c] > 0) {
+                (*request.mutable_counters())[std::string(mapreduce::counter_names[c])] = metrics.counters[c];
+            }
+        }
+        for (size_t h = 0; h < metrics.num_histograms; h++) {
+            if (metrics.count(static_cast<Histogram>(h)) == 0) {
+                continue;
+            }
+            auto* histogram = request.add_histograms();
+            histogram->set_name(std::string(mapreduce::histogram_names[h]));
+            histogram->mutable_bucket()->Add(metrics.buckets[h].begin(), metrics.buckets[h].end());
+            histogram->set_sum(metrics.sums[h]);
+        }
+        for (size_t p = 0; p < stats.partition_records.size(); p++) {
+            auto* size = request.add_partition_size();
+            size->set_records(stats.partition_records[p]);
+            size->set_bytes(stats.partition_bytes[p]);
+        }
+        for (const auto& entry : stats.heavy_hitters) {
+            auto* heavy_hitter = request.add_heavy_hitter();
+            heavy_hitter->set_key(entry.key);
+            heavy_hitter->set_count(entry.count);
+            heavy_hitter->set_partition(entry.partition);
+        }
+        request.set_has_combine(stats.has_combine);
+        request.set_failed(failed);
         
+        const auto sent = std::chrono::steady_clock::now();
         Status status = stub_->Complete(&context, request, &reply);
+        Metrics::record(Histogram::RPC_COMPLETE_US, mapreduce::elapsedUs(sent));
         if (status.ok()) {
             return reply;
         } else {
@@ -67,163 +162,996 @@ class CoordinatorClient {
             return {}; // FIXME: Should we throw an exception here?
         }
     }
-    
+
+    MapOutputsReply MapOutputs(std::string worker_id, uint32_t task_id, uint32_t attempt_id, uint32_t start,
+                               const std::vector<LostMapOutput>& lost) {
+        MapOutputsRequest request;
+        MapOutputsReply reply;
+        ClientContext context;
+
+        request.set_worker_id(worker_id);
+        request.set_task_id(task_id);
+        request.set_attempt_id(attempt_id);
+        request.set_start(start);
+        for (const auto& output : lost) {
+            *request.add_lost_map_output() = output;
+        }
+
+        const auto sent = std::chrono::steady_clock::now();
+        Status status = stub_->MapOutputs(&context, request, &reply);
+        Metrics::record(Histogram::RPC_MAP_OUTPUTS_US, mapreduce::elapsedUs(sent));
+        if (!status.ok()) {
+            std::cerr << "MapOutputs RPC failed: " << status.error_code() << ": " << status.error_message() << std::endl;
+            throw std::runtime_error("MapOutputs RPC failed");
+        }
+        return reply;
+    }
+
+    HeartbeatReply Heartbeat(std::string worker_id, std::string taskname, uint32_t task_id, uint32_t attempt_id) {
+        HeartbeatRequest request;
+        HeartbeatReply reply;
+        ClientContext context;
+
+        request.set_worker_id(worker_id);
+        request.set_taskname(taskname);
+        request.set_task_id(task_id);
+        request.set_attempt_id(attempt_id);
+
+        // A missed heartbeat is not fatal, the lease only expires after several of them
+        const auto sent = std::chrono::steady_clock::now();
+        Status status = stub_->Heartbeat(&context, request, &reply);
+        Metrics::record(Histogram::RPC_HEARTBEAT_US, mapreduce::elapsedUs(sent));
+        if (!status.ok()) {
+            std::cerr << "Heartbeat RPC failed: " << status.error_code() << ": " << status.error_message() << std::endl;
+        }
+        return reply;
+    }
     
     private:
     std::unique_ptr<Coordinator::Stub> stub_;
 };
 
-// Emit function
+// Renews the lease of a task attempt by sending heartbeats on a background thread while the
+// task runs. If the coordinator cancels the attempt, because another attempt of the task
+// completed first or the lease expired, cancelled is set and the task stops early.
+class TaskHeartbeat {
+    public:
+    TaskHeartbeat(CoordinatorClient& client, const std::string& worker_id, const AssignReply& reply)
+        : thread([this, &client, worker_id, reply] {
+            const auto interval = std::chrono::milliseconds(reply.heartbeat_interval_ms() > 0 ? reply.heartbeat_interval_ms() : 1000);
+            std::unique_lock<std::mutex> lock(this->mutex);
+            while (!this->stop_requested.wait_for(lock, interval, [this] { return this->stopping; })) {
+                lock.unlock();
+                HeartbeatReply heartbeat = client.Heartbeat(worker_id, reply.taskname(), reply.task_id(), reply.attempt_id());
+                if (heartbeat.cancel()) {
+                    this->cancelled = true;
+                }
+                lock.lock();
+            }
+        }) { }
+
+    ~TaskHeartbeat() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->stop_requested.notify_all();
+        this->thread.join();
+    }
+
+    std::atomic<bool> cancelled = false;
+
+    private:
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread thread; // Declared last, so that it starts once the other members are initialized
+};
+
+// Serves the intermediate files of the map tasks completed by the worker to the reduce tasks
+// of other workers. Only files that were registered with serve() can be fetched, so the
+// service can't be used to read arbitrary files of the host.
+class ShuffleServiceImpl final : public Shuffle::Service {
+    public:
+    void serve(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->files.insert(filename);
+    }
+
+    void stopServing(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->files.erase(filename);
+    }
+
+    Status FetchPartition(ServerContext* context, const FetchPartitionRequest* request, ServerWriter<PartitionChunk>* writer) override {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->files.contains(request->filename())) {
+                return Status(grpc::StatusCode::NOT_FOUND, "Not an intermediate file of this worker");
+            }
+        }
+        mapreduce::MappedFile file(request->filename());
+        if (!file.is_open()) {
+            return Status(grpc::StatusCode::NOT_FOUND, "Failed to open " + request->filename());
+        }
+        if (request->compress()) {
+            context->set_compression_algorithm(GRPC_COMPRESS_GZIP);
+        }
+
+        // Write() blocks while the reducer's flow control window is full, so at most a few
+        // chunks of the file are in flight at once
+        std::string_view data = file.data();
+        PartitionChunk chunk;
+        for (size_t offset = 0; offset < data.size(); offset += chunk_size) {
+            std::string_view piece = data.substr(offset, chunk_size);
+            chunk.set_data(piece.data(), piece.size());
+            if (!writer->Write(chunk)) {
+                return Status(grpc::StatusCode::CANCELLED, "Reducer went away");
+            }
+        }
+        return Status::OK;
+    }
+
+    private:
+    static constexpr size_t chunk_size = 1024 * 1024;
+    std::mutex mutex;
+    std::unordered_set<std::string> files;
+};
+
+// Fetches intermediate files from the Shuffle services of other workers. Channels are cached
+// per address, so every reducer of the worker shares one connection to each mapper.
+class ShuffleClient {
+    public:
+    // Copy a remote intermediate file into a local file. Failing to write the local file is
+    // reported as INTERNAL, any other error means the remote file could not be read.
+    Status Fetch(const std::string& address, const std::string& filename, const std::string& local_filename, bool compress) {
+        FetchPartitionRequest request;
+        PartitionChunk chunk;
+        ClientContext context;
+
+        request.set_filename(filename);
+        request.set_compress(compress);
+
+        std::ofstream output(local_filename, std::ios::binary | std::ios::trunc);
+        if (!output.is_open()) {
+            return Status(grpc::StatusCode::INTERNAL, "Failed to open fetched file: " + local_filename);
+        }
+        std::unique_ptr<ClientReader<PartitionChunk>> reader(stub(address).FetchPartition(&context, request));
+        while (reader->Read(&chunk)) {
+            output.write(chunk.data().data(), chunk.data().size());
+        }
+        Status status = reader->Finish();
+        output.close();
+        if (status.ok() && output.fail()) {
+            return Status(grpc::StatusCode::INTERNAL, "Failed to write fetched file: " + local_filename);
+        }
+        return status;
+    }
+
+    private:
+    Shuffle::Stub& stub(const std::string& address) {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto& stub = this->stubs[address];
+        if (!stub) {
+            // Keepalive pings fail the fetches from a worker that died or hung mid-stream, instead
+            // of waiting for it forever
+            grpc::ChannelArguments args;
+            args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, 10000);
+            args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, 10000);
+            stub = Shuffle::NewStub(grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args));
+        }
+        return *stub;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<Shuffle::Stub>> stubs;
+};
+
+// Shuffle service of the worker and the address it is reachable at, the address is empty if
+// the worker was not started with one and the reducers read its files from the shared filesystem
+std::unique_ptr<ShuffleServiceImpl> shuffle_service;
+std::string shuffle_address;
+ShuffleClient shuffle_client;
+// Number of intermediate files a reduce task fetches from other workers at once
+constexpr size_t max_concurrent_fetches = 8;
+
+// Legacy map and reduce functions, which take NUL-terminated strings
+typedef void (*map_func_t)(const char* input, void (*emit) (const char*, const char*));
+typedef void (*reduce_func_t)(const char* key, const char* const* values, int values_len, void (*emit) (const char*, const char*));
+// Optional partition function, returns the reduce partition in [0, num_partitions) of the key
+typedef int (*partition_func_t)(const char* key, int num_partitions);
+// Optional combine function, has the same signature as reduce and is run on the map side
+typedef reduce_func_t combine_func_t;
+
+// Functions loaded from the user shared object. The sized functions of mapreduce_abi.h are
+// preferred, the legacy ones are only set if the sized ones are not exported.
+struct UserFunctions {
+    mr_map_t map = nullptr;
+    mr_reduce_t reduce = nullptr;
+    mr_reduce_t combine = nullptr;
+    mr_partition_t partition = nullptr;
+    map_func_t legacy_map = nullptr;
+    reduce_func_t legacy_reduce = nullptr;
+    combine_func_t legacy_combine = nullptr;
+    partition_func_t legacy_partition = nullptr;
+
+    bool has_combine() const {
+        return this->combine || this->legacy_combine;
+    }
+};
+
+UserFunctions user;
+
+// Input files mapped recently by any slot of the worker, most recent first. They are reported to
+// the coordinator, which prefers assigning splits of files whose pages are still in memory.
+std::mutex recent_inputs_mutex;
+std::deque<std::string> recent_inputs;
+constexpr size_t max_recent_inputs = 16;
+
+void remember_input(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(recent_inputs_mutex);
+    std::erase(recent_inputs, filename);
+    recent_inputs.push_front(filename);
+    if (recent_inputs.size() > max_recent_inputs) {
+        recent_inputs.pop_back();
+    }
+}
+
+std::vector<std::string> cached_inputs() {
+    std::lock_guard<std::mutex> lock(recent_inputs_mutex);
+    return std::vector<std::string>(recent_inputs.begin(), recent_inputs.end());
+}
+
+// Threads that map the chunks of a split and sort the spills of a map task in parallel, shared
+// by all the task slots. Not created unless the worker is started with more than one map thread.
+std::unique_ptr<mapreduce::ThreadPool> map_pool;
+// Splits are only mapped in parallel if they can be cut into chunks of at least this size
+constexpr size_t min_chunk_size = 256 * 1024;
+
+// State of the running task. It is passed to the sized user functions as their ctx argument,
+// and the emit functions use it to find where the records go.
+struct TaskContext {
+    mapreduce::MapOutputBuffer* map_output = nullptr;
+    mapreduce::RecordWriter* combine_output = nullptr;
+    mapreduce::RecordWriter* final_output = nullptr;
+    std::string_view reduce_key; // Key whose values are being reduced, the final output is keyed by it
+    std::string output_line;
+    const std::vector<std::string>* partition_boundaries = nullptr; // Range partitioning, if not empty
+    bool invalid_partition = false;
+    mapreduce::HeavyHitters* sampled_keys = nullptr; // One in key_sample_interval emitted keys, null if not sampled
+    size_t num_emitted = 0;
+};
+
+// Emitted keys are sampled into the heavy hitters sketch of a map task at this interval, every
+// sampled key counts for the keys that were skipped
+constexpr size_t key_sample_interval = 16;
+// Size of the sketch, and number of its keys that are reported to the coordinator
+constexpr size_t sampled_keys_capacity = 64;
+constexpr size_t reported_heavy_hitters = 8;
+
+// The legacy functions don't take a context, so their emit functions use the current task of
+// the calling thread.
 // I don't like this global variable, but it's the only way to pass the emit function to the map function.
 // The map_func and reduce_func can't take a std::function as an argument because they are called from dlsym, 
 // and that seems to cause segmentation faults, probably something to do with the name mangling.
-std::vector<std::pair<std::string, std::string>> intermediate;
+thread_local TaskContext* current_task = nullptr;
+
+// The user's partition function comes first, then the job's range partitioning
+size_t partition_key(std::string_view key, size_t num_partitions, const std::vector<std::string>& boundaries) {
+    if (user.partition) {
+        return user.partition(key.data(), key.size(), num_partitions);
+    } else if (user.legacy_partition) {
+        return user.legacy_partition(std::string(key).c_str(), num_partitions);
+    } else if (!boundaries.empty()) {
+        return mapreduce::rangePartition(key, boundaries);
+    }
+    return mapreduce::defaultPartition(key, num_partitions);
+}
+
+// Emit functions
+void emit_intermediate_n(void* ctx, const char* key, size_t key_len, const char* value, size_t value_len) {
+    TaskContext* task = static_cast<TaskContext*>(ctx);
+    const size_t num_partitions = task->map_output->partitions();
+    std::string_view key_view(key, key_len);
+    size_t r = partition_key(key_view, num_partitions, *task->partition_boundaries);
+    if (r >= num_partitions) {
+        std::cerr << "Partition function returned invalid partition " << r << " for key: " << key_view << std::endl;
+        task->invalid_partition = true;
+        return;
+    }
+    task->map_output->add(r, key_view, std::string_view(value, value_len));
+    if (task->sampled_keys && task->num_emitted++ % key_sample_interval == 0) {
+        task->sampled_keys->add(key_view, r, key_sample_interval);
+    }
+}
+
 void emit_intermediate(const char* key, const char* value) {
-    intermediate.push_back({key, value});
+    emit_intermediate_n(current_task, key, strlen(key), value, strlen(value));
+}
+
+// Final and combined pairs are streamed to their output file instead of being buffered. Final
+// pairs are written as lines of text, see mapreduce::outputLine.
+void emit_final_n(void* ctx, const char* key, size_t key_len, const char* value, size_t value_len) {
+    TaskContext* task = static_cast<TaskContext*>(ctx);
+    mapreduce::outputLine(task->output_line, std::string_view(key, key_len), std::string_view(value, value_len));
+    task->final_output->write(task->reduce_key, task->output_line);
 }
 
-std::vector<std::pair<std::string, std::string>> intermediate_final;
 void emit_final(const char* key, const char* value) {
-    intermediate_final.push_back({key, value});
+    emit_final_n(current_task, key, strlen(key), value, strlen(value));
 }
 
-// Map and reduce functions
-typedef void (*map_func_t)(const char* input, void (*emit) (const char*, const char*));
-typedef void (*reduce_func_t)(const char* key, const char* const* values, int values_len, void (*emit) (const char*, const char*));
-  
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <worker_id> <map_reduce_functions.so>" << std::endl;
-        return 1;
+void emit_combined_n(void* ctx, const char* key, size_t key_len, const char* value, size_t value_len) {
+    static_cast<TaskContext*>(ctx)->combine_output->write(std::string_view(key, key_len), std::string_view(value, value_len));
+}
+
+void emit_combined(const char* key, const char* value) {
+    emit_combined_n(current_task, key, strlen(key), value, strlen(value));
+}
+
+// Call a reduce or combine function with one group of values. The key and values are
+// NUL-terminated, which the legacy functions rely on.
+void call_reduce(TaskContext* task, mr_reduce_t func, reduce_func_t legacy_func, std::string_view key,
+                 const std::vector<std::string_view>& values, mr_emit_t emit, void (*legacy_emit) (const char*, const char*)) {
+    if (func) {
+        std::vector<mr_slice> slices;
+        slices.reserve(values.size());
+        for (const auto& value : values) {
+            slices.push_back({value.data(), value.size()});
+        }
+        func(task, key.data(), key.size(), slices.data(), slices.size(), emit);
+        return;
     }
 
-    std::string so_filename = argv[2];
-    std::cout << "Loading shared object: " << so_filename << std::endl;
-    
-    void* handle = dlopen(so_filename.c_str(), RTLD_LAZY);
-    if (!handle) {
-        std::cerr << "dlopen() failed: " << dlerror() << std::endl;
-        return 1;
+    std::vector<const char*> value_ptrs; // Must be a vector of const char* because that's what the reduce function expects
+    value_ptrs.reserve(values.size());
+    for (const auto& value : values) {
+        value_ptrs.push_back(value.data());
     }
+    current_task = task;
+    legacy_func(key.data(), value_ptrs.data(), value_ptrs.size(), legacy_emit);
+}
 
-    map_func_t map_func = (map_func_t)dlsym(handle, "map");
-    if (!map_func) {
-        std::cerr << "dlsym() failed for map: " << dlerror() << std::endl;
-        return 1;
+bool load_user_functions(void* handle) {
+    user.map = (mr_map_t)dlsym(handle, "mr_map");
+    if (!user.map) {
+        user.legacy_map = (map_func_t)dlsym(handle, "map");
+        if (!user.legacy_map) {
+            std::cerr << "dlsym() failed for mr_map and map: " << dlerror() << std::endl;
+            return false;
+        }
     }
 
-    reduce_func_t reduce_func = (reduce_func_t)dlsym(handle, "reduce");
-    if (!reduce_func) {
-        std::cerr << "dlsym() failed for reduce: " << dlerror() << std::endl;
-        return 1;
+    user.reduce = (mr_reduce_t)dlsym(handle, "mr_reduce");
+    if (!user.reduce) {
+        user.legacy_reduce = (reduce_func_t)dlsym(handle, "reduce");
+        if (!user.legacy_reduce) {
+            std::cerr << "dlsym() failed for mr_reduce and reduce: " << dlerror() << std::endl;
+            return false;
+        }
     }
 
-    std::cout << "Loaded map and reduce functions" << std::endl;
+    // The combine function is optional, when present it pre-aggregates the map output
+    user.combine = (mr_reduce_t)dlsym(handle, "mr_combine");
+    if (!user.combine) {
+        user.legacy_combine = (combine_func_t)dlsym(handle, "combine");
+    }
+    if (user.has_combine()) {
+        std::cout << "Loaded combine function" << std::endl;
+    }
 
-    std::string worker_id = argv[1];
+    // The partition function is optional, by default keys are partitioned by hash(key) mod R
+    user.partition = (mr_partition_t)dlsym(handle, "mr_partition");
+    if (!user.partition) {
+        user.legacy_partition = (partition_func_t)dlsym(handle, "partition");
+    }
+    if (user.partition || user.legacy_partition) {
+        std::cout << "Loaded partition function" << std::endl;
+    }
 
-    CoordinatorClient client(grpc::CreateChannel("0.0.0.0:8995", grpc::InsecureChannelCredentials()));
+    return true;
+}
 
-    // Infinite loop to keep the worker running
-    for (;;) {
-        AssignReply reply = client.Assign(worker_id);
-        
-        // TODO: Check if the reply is empty
-        std::string input;
-        for (const auto& filename : reply.input_filename()) {
-            std::stringstream buffer;
-            std::ifstream input_file(filename);
-            if (!input_file.is_open()) {
-                std::cerr << "Failed to open input file: " << filename << std::endl;
-                return 1;
-            }
-            buffer << input_file.rdbuf();
-            input.append(buffer.str());
-            input_file.close();
+// Run the map function on a range of whole records, and sample the emitted keys into
+// sampled_keys unless it is null. Returns false if it emitted a key to an invalid partition.
+bool map_records(mapreduce::MapOutputBuffer& buffer, std::string_view records, const std::vector<std::string>& partition_boundaries,
+                 mapreduce::HeavyHitters* sampled_keys) {
+    TaskContext task;
+    task.map_output = &buffer;
+    task.partition_boundaries = &partition_boundaries;
+    task.sampled_keys = sampled_keys;
+    if (user.map) {
+        user.map(&task, records.data(), records.size(), emit_intermediate_n);
+    } else {
+        // The legacy map function needs a NUL-terminated copy
+        std::string input_copy(records);
+        current_task = &task;
+        user.legacy_map(input_copy.c_str(), emit_intermediate);
+    }
+    return !task.invalid_partition;
+}
+
+// Run the map function on the records of a split in parallel. The records are cut into chunks
+// at line boundaries, and the chunks are mapped on the map pool. Every thread that picks up a
+// chunk takes a buffer of its own, and the runs of those buffers are handed to the task's
+// buffer to be merged. The keys sampled from every chunk are added to sampled_keys, if not
+// null. Returns false if a chunk failed.
+bool map_records_parallel(mapreduce::MapOutputBuffer& buffer, std::string_view records, const AssignReply& reply,
+                          const std::vector<std::string>& partition_boundaries, const mapreduce::WriterOptions& options,
+                          const mapreduce::MapOutputBuffer::Combiner& combiner, mapreduce::HeavyHitters* sampled_keys,
+                          const std::atomic<bool>& cancelled) {
+    const size_t num_chunks = std::min(records.size() / min_chunk_size, map_pool->size() * 4);
+    const size_t chunk_size = records.size() / num_chunks + 1;
+    std::vector<std::string_view> chunks;
+    for (size_t i = 0; i < num_chunks; i++) {
+        chunks.push_back(mapreduce::splitRecords(records, i * chunk_size, chunk_size));
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<mapreduce::MapOutputBuffer>> buffers;
+    std::vector<mapreduce::MapOutputBuffer*> idle_buffers;
+    std::atomic<bool> ok = true;
+    map_pool->parallelFor(chunks.size(), [&](size_t i) {
+        if (cancelled) {
+            return;
         }
-        
-        // Call the map or reduce function
-        std::string taskname = reply.taskname();
-        if (taskname == "map") {
-            // Sort the input by key
-            // Intermediate key-value store
-            map_func(input.c_str(), emit_intermediate);
-            
-            // Write the intermediate key-value pairs to the output file
-            std::ofstream output_file(reply.output_filename());
-            if (!output_file.is_open()) {
-                std::cerr << "Failed to open output file: " << reply.output_filename() << std::endl;
-                return 1;
+        mapreduce::MapOutputBuffer* chunk_buffer;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (idle_buffers.empty()) {
+                // The sort buffer is shared between the threads of the task
+                std::string prefix = reply.output_filename() + ".t" + std::to_string(buffers.size());
+                buffers.push_back(std::make_unique<mapreduce::MapOutputBuffer>(
+                    prefix, reply.num_reducers(), reply.sort_buffer_size() / map_pool->size(), options, combiner));
+                idle_buffers.push_back(buffers.back().get());
             }
+            chunk_buffer = idle_buffers.back();
+            idle_buffers.pop_back();
+        }
+        mapreduce::HeavyHitters chunk_keys(sampled_keys_capacity);
+        if (!map_records(*chunk_buffer, chunks[i], partition_boundaries, sampled_keys ? &chunk_keys : nullptr)) {
+            ok = false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        idle_buffers.push_back(chunk_buffer);
+        if (sampled_keys) {
+            sampled_keys->merge(chunk_keys);
+        }
+    });
+
+    for (auto& chunk_buffer : buffers) {
+        if (!chunk_buffer->flush()) {
+            ok = false;
+        }
+        buffer.absorb(*chunk_buffer);
+    }
+    return ok;
+}
+
+// Options of the intermediate files written by a task. Blocks are written uncompressed if the
+// worker was built without the job's codec, which every worker can still read.
+mapreduce::WriterOptions writer_options(const AssignReply& reply) {
+    mapreduce::WriterOptions options;
+    options.checksums = reply.intermediate_checksums();
+    options.key_order = reply.hash_order() ? mapreduce::KeyOrder::HASH : mapreduce::KeyOrder::BYTES;
+    if (!mapreduce::parseCompression(reply.compression(), options.compression)) {
+        std::cerr << "Unknown compression " << reply.compression() << ", writing uncompressed blocks" << std::endl;
+    } else if (!mapreduce::compressionAvailable(options.compression)) {
+        std::cerr << "Compression " << reply.compression() << " is not available, writing uncompressed blocks" << std::endl;
+    }
+    return options;
+}
+
+// Run a map task and fill in the stats of its output, returns false if it failed or was cancelled
+bool run_map_task(const AssignReply& reply, const std::atomic<bool>& cancelled, MapOutputStats& stats) {
+    // The map output is partitioned into one file per reduce task, and buffered in
+    // memory until the sort buffer is full. The combiner is run on every sorted run.
+    mapreduce::MapOutputBuffer::Combiner combiner;
+    if (user.has_combine()) {
+        combiner = [](std::string_view key, const std::vector<std::string_view>& values, mapreduce::RecordWriter& writer) {
+            TaskContext task;
+            task.combine_output = &writer;
+            call_reduce(&task, user.combine, user.legacy_combine, key, values, emit_combined_n, emit_combined);
+        };
+    }
+    mapreduce::WriterOptions options = writer_options(reply);
+    // Its spills are sorted on the map pool, the buffers of the chunks mapped in parallel
+    // are already spilled by the pool threads so they sort on their own
+    mapreduce::MapOutputBuffer buffer(reply.output_filename(), reply.num_reducers(), reply.sort_buffer_size(), options, combiner, map_pool.get());
+    const std::vector<std::string> partition_boundaries(reply.partition_boundary().begin(), reply.partition_boundary().end());
+
+    // The input is memory-mapped, and the map function scans the mapped pages directly
+    // Keys are only sampled for jobs that split skewed partitions
+    mapreduce::HeavyHitters sampled_keys(sampled_keys_capacity);
+    mapreduce::HeavyHitters* sample = reply.sample_keys() ? &sampled_keys : nullptr;
+    bool ok = true;
+    const auto map_start = std::chrono::steady_clock::now();
+    for (const auto& split : reply.input_split()) {
+        if (cancelled) {
+            return false;
+        }
+        mapreduce::MappedFile input(split.filename());
+        if (!input.is_open()) {
+            std::cerr << "Failed to open input file: " << split.filename() << std::endl;
+            return false;
+        }
+        std::string_view records = mapreduce::splitRecords(input.data(), split.offset(), split.length());
+        remember_input(split.filename());
+        Metrics::add(Counter::MAP_INPUT_BYTES, records.size());
+
+        if (map_pool && records.size() >= 2 * min_chunk_size) {
+            ok = map_records_parallel(buffer, records, reply, partition_boundaries, options, combiner, sample, cancelled) && ok;
+        } else {
+            ok = map_records(buffer, records, partition_boundaries, sample) && ok;
+        }
+    }
+
+    Metrics::add(Counter::MAP_FUNCTION_NS, std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - map_start).count());
+    if (cancelled) {
+        return false;
+    }
+    if (!ok || !buffer.finish()) {
+        std::cerr << "Failed to write the output of map task " << reply.task_id() << std::endl;
+        return false;
+    }
+
+    std::cout << "Wrote " << buffer.written() << " of " << buffer.added() << " key-value pairs to "
+              << reply.num_reducers() << " partitions of " << reply.output_filename()
+              << " (" << buffer.spills() << " spills)" << std::endl;
+    Metrics::add(Counter::MAP_TASKS, 1);
+    Metrics::add(Counter::MAP_OUTPUT_RECORDS, buffer.added());
+    Metrics::add(Counter::MAP_WRITTEN_RECORDS, buffer.written());
+
+    for (size_t p = 0; p < buffer.partitions(); p++) {
+        stats.partition_records.push_back(buffer.written(p));
+        stats.partition_bytes.push_back(buffer.writtenBytes(p));
+    }
+    stats.heavy_hitters = sampled_keys.top(reported_heavy_hitters);
+    stats.has_combine = user.has_combine();
+    return true;
+}
+
+// Remove the files written by an attempt of a map task that did not win: its intermediate
+// files, spills and the runs of its threads
+void remove_map_outputs(const std::string& output_prefix) {
+    std::filesystem::path prefix(output_prefix);
+    std::filesystem::path dir = prefix.has_parent_path() ? prefix.parent_path() : std::filesystem::path(".");
+    const std::string name = prefix.filename().string();
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        const std::string filename = entry.path().filename().string();
+        if (filename.starts_with(name + "-") || filename.starts_with(name + ".t")) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+// Every attempt of a reduce task writes its output and runs to files of its own, named after this
+std::string reduce_attempt_filename(const AssignReply& reply) {
+    return reply.output_filename() + ".attempt-" + std::to_string(reply.attempt_id());
+}
 
-            for (const auto& kv : intermediate) {
-                output_file << kv.first << "\t" << kv.second << std::endl;
+// Remove the files written by a failed attempt of a reduce task: its output, and the runs it
+// merged or fetched
+void remove_reduce_outputs(const AssignReply& reply) {
+    std::filesystem::path attempt(reduce_attempt_filename(reply));
+    std::filesystem::path dir = attempt.has_parent_path() ? attempt.parent_path() : std::filesystem::path(".");
+    const std::string name = attempt.filename().string();
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+        const std::string filename = entry.path().filename().string();
+        if (filename == name || filename.starts_with(name + ".")) {
+            std::filesystem::remove(entry.path(), error);
+        }
+    }
+}
+
+// Add the intermediate files of a MapOutputs reply to the runs of a reduce task, skipping the
+// map tasks it already has. Files served by other workers are fetched concurrently into local
+// files next to the task's output, files of this worker or of the shared filesystem are read in
+// place. Files that could not be fetched are added to lost, so that their map tasks run again.
+// Returns false if a fetched file could not be written.
+bool fetch_map_outputs(const MapOutputsReply& outputs, const std::string& attempt_filename, bool compress,
+                       std::unordered_set<uint32_t>& received_maps, std::vector<std::string>& runs,
+                       std::vector<std::string>& fetched_runs, std::vector<LostMapOutput>& lost) {
+    struct Fetch {
+        uint32_t map_task_id;
+        std::string address;
+        std::string filename;
+        std::string local_filename;
+        Status status;
+    };
+    std::vector<Fetch> fetches;
+    for (int i = 0; i < outputs.input_filename_size(); i++) {
+        const uint32_t map_task_id = i < outputs.map_task_id_size() ? outputs.map_task_id(i) : i;
+        if (received_maps.contains(map_task_id)) {
+            continue;
+        }
+        const std::string address = i < outputs.shuffle_address_size() ? outputs.shuffle_address(i) : "";
+        if (address.empty() || address == shuffle_address) {
+            received_maps.insert(map_task_id);
+            runs.push_back(outputs.input_filename(i));
+            continue;
+        }
+        std::string local_filename = attempt_filename + ".fetch-" + std::to_string(fetched_runs.size());
+        fetched_runs.push_back(local_filename);
+        fetches.push_back({map_task_id, address, outputs.input_filename(i), local_filename, Status::OK});
+    }
+
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> fetchers;
+    for (size_t t = 0; t < std::min(fetches.size(), max_concurrent_fetches); t++) {
+        fetchers.emplace_back([&] {
+            for (size_t j = next++; j < fetches.size(); j = next++) {
+                Fetch& fetch = fetches[j];
+                const auto start = std::chrono::steady_clock::now();
+                fetch.status = shuffle_client.Fetch(fetch.address, fetch.filename, fetch.local_filename, compress);
+                Metrics::record(Histogram::SHUFFLE_FETCH_US, mapreduce::elapsedUs(start));
             }
-            
-            std::cout << "Wrote " << intermediate.size() << " key-value pairs to " << reply.output_filename() << std::endl;
+        });
+    }
+    for (auto& fetcher : fetchers) {
+        fetcher.join();
+    }
 
-            output_file.close();
-            
-            // Send the intermediate file name to the coordinator to notify them that we're done
-        } else if (taskname == "reduce") {
-            // Convert the input string to a vector of key-value pairs
-            size_t start = 0; 
-            while (start < input.size()) {
-                size_t end = input.find('\n', start);
-                if (end == std::string::npos) {
-                    end = input.size();
-                }
-                std::string line = input.substr(start, end - start);
-                size_t tab = line.find('\t');
-                std::string key = line.substr(0, tab);
-                std::string value = line.substr(tab + 1);
-                intermediate.push_back({key, value});
-                start = end + 1;
+    bool ok = true;
+    for (const auto& fetch : fetches) {
+        if (fetch.status.ok()) {
+            received_maps.insert(fetch.map_task_id);
+            runs.push_back(fetch.local_filename);
+            Metrics::add(Counter::SHUFFLE_FETCHES, 1);
+            std::error_code error;
+            const auto size = std::filesystem::file_size(fetch.local_filename, error);
+            Metrics::add(Counter::SHUFFLE_FETCHED_BYTES, error ? 0 : size);
+            continue;
+        }
+        std::cerr << "Failed to fetch " << fetch.filename << " from " << fetch.address << ": "
+                  << fetch.status.error_code() << ": " << fetch.status.error_message() << std::endl;
+        if (fetch.status.error_code() == grpc::StatusCode::INTERNAL) {
+            ok = false;
+            continue;
+        }
+        LostMapOutput output;
+        output.set_map_task_id(fetch.map_task_id);
+        output.set_shuffle_address(fetch.address);
+        lost.push_back(output);
+    }
+    return ok;
+}
+
+// Run a reduce task, returns false if it failed or was cancelled. A partial task, which reduces
+// one share of a split partition, combines its inputs into intermediate records instead.
+bool run_reduce_task(CoordinatorClient& client, const std::string& worker_id, const AssignReply& reply, std::atomic<bool>& cancelled) {
+    if (reply.partial() && !user.has_combine()) {
+        std::cerr << "Reduce task " << reply.task_id() << " is partial, but there is no combine function" << std::endl;
+        return false;
+    }
+    // Several attempts of the task may run at once, so every attempt writes to files of its
+    // own, and the output is renamed to its final name once it is complete
+    const std::string attempt_filename = reduce_attempt_filename(reply);
+
+    // Fetch the intermediate files of the partition as the map tasks complete. While
+    // waiting for the remaining map tasks, every merge_factor runs are merged into one,
+    // so only a few runs are left to merge once the last map task completes.
+    mapreduce::WriterOptions options = writer_options(reply);
+    const size_t merge_factor = std::max<size_t>(reply.merge_factor(), 2);
+    std::vector<std::string> runs;
+    std::vector<std::string> merged_runs; // Local runs, removed once the task is done
+    std::vector<std::string> fetched_runs; // Copies of remote intermediate files, removed once the task is done
+    std::unordered_set<uint32_t> received_maps; // Map tasks whose output is in the runs
+    std::vector<LostMapOutput> lost; // Map outputs that could not be fetched, reported to the coordinator
+    size_t num_received = 0;
+    auto remove_merged_runs = [&merged_runs, &fetched_runs] {
+        for (const auto& filename : merged_runs) {
+            std::filesystem::remove(filename);
+        }
+        for (const auto& filename : fetched_runs) {
+            std::filesystem::remove(filename);
+        }
+    };
+    for (;;) {
+        MapOutputsReply outputs = client.MapOutputs(worker_id, reply.task_id(), reply.attempt_id(), num_received, lost);
+        lost.clear();
+        if (outputs.cancelled() || cancelled) {
+            cancelled = true;
+            remove_merged_runs();
+            return false;
+        }
+        num_received = outputs.next_start();
+        if (!fetch_map_outputs(outputs, attempt_filename, reply.shuffle_compression(), received_maps, runs, fetched_runs, lost)) {
+            remove_merged_runs();
+            return false;
+        }
+        // The lost outputs are reported with the next request, and sent again once their map
+        // tasks have run again
+        if (outputs.complete() && lost.empty()) {
+            break;
+        }
+
+        while (runs.size() >= merge_factor) {
+            std::vector<std::string> batch(runs.begin(), runs.begin() + merge_factor);
+            runs.erase(runs.begin(), runs.begin() + merge_factor);
+            std::string merged = attempt_filename + ".merge-" + std::to_string(merged_runs.size());
+            mapreduce::ScopedTimer timer(Counter::REDUCE_MERGE_NS);
+            if (!mapreduce::mergeRuns(batch, merged, options)) {
+                std::cerr << "Failed to merge intermediate files into " << merged << std::endl;
+                remove_merged_runs();
+                std::error_code error;
+                std::filesystem::remove(merged, error);
+                return false;
             }
+            merged_runs.push_back(merged);
+            runs.push_back(merged);
+        }
+    }
+    std::cout << "Received " << received_maps.size() << " intermediate files (" << fetched_runs.size() << " fetched), merged " << merged_runs.size()
+              << " runs before the map tasks completed" << std::endl;
 
-            // Sort the intermediate key-value pairs
-            std::sort(intermediate.begin(), intermediate.end()); 
-            
-            // Aggregate values and send them to the reducer function
-            std::string current_key = intermediate[0].first;
-            std::vector<const char*> values; // Must be a vector of const char* because that's what the reduce function expects
-            for (const auto& kv : intermediate) {
-                if (kv.first != current_key) {
-                    const char* const* values_data = values.data(); // Implicit conversion from vector<const char*> to const char* const*
-                    reduce_func(current_key.c_str(), values_data, values.size(), emit_final);
-                    current_key = kv.first;
-                    values.clear();
+    // Every run is sorted, so they are merged as a stream instead of being loaded and
+    // sorted in memory. The user reduce function only runs once all inputs are in.
+    std::vector<std::unique_ptr<mapreduce::RecordSource>> sources;
+    for (const auto& filename : runs) {
+        auto reader = std::make_unique<mapreduce::RecordReader>(filename);
+        if (!reader->is_open()) {
+            std::cerr << "Failed to open input file: " << filename << std::endl;
+            return false;
+        }
+        sources.push_back(std::move(reader));
+    }
+    mapreduce::MergeIterator merge(std::move(sources), options.key_order);
+
+    // The output is written as records too, the coordinator turns the outputs of all the
+    // reduce tasks into the job's output file once they are done. The output of a partial
+    // task is in the same order as its input, so that it can be merged as an intermediate file.
+    mapreduce::RecordWriter final_output(attempt_filename, options);
+    if (!final_output.is_open()) {
+        std::cerr << "Failed to open output file: " << attempt_filename << std::endl;
+        return false;
+    }
+
+    std::cout << "Writing final key-value pairs to " << reply.output_filename() << std::endl;
+
+    // Aggregate values and send them to the reducer function
+    TaskContext task;
+    task.final_output = &final_output;
+    task.combine_output = &final_output;
+    size_t num_groups = 0;
+    size_t num_records = 0;
+    {
+        mapreduce::ScopedTimer timer(Counter::REDUCE_FUNCTION_NS);
+        mapreduce::groupByKey(merge, [&](std::string_view key, const std::vector<std::string_view>& values) {
+            task.reduce_key = key;
+            if (reply.partial()) {
+                call_reduce(&task, user.combine, user.legacy_combine, key, values, emit_combined_n, emit_combined);
+            } else {
+                call_reduce(&task, user.reduce, user.legacy_reduce, key, values, emit_final_n, emit_final);
+            }
+            num_groups++;
+            num_records += values.size();
+        });
+    }
+    Metrics::add(Counter::REDUCE_INPUT_GROUPS, num_groups);
+    Metrics::add(Counter::REDUCE_INPUT_RECORDS, num_records);
+
+    const bool written = final_output.close();
+    remove_merged_runs();
+    if (!written || cancelled) {
+        std::filesystem::remove(attempt_filename);
+        return false;
+    }
+
+    // The rename is atomic, so the output file is never seen half written. Attempts of the
+    // same task produce the same output, so it doesn't matter if a slower attempt replaces it.
+    std::error_code error;
+    std::filesystem::rename(attempt_filename, reply.output_filename(), error);
+    if (error) {
+        std::cerr << "Failed to rename " << attempt_filename << " to " << reply.output_filename() << ": " << error.message() << std::endl;
+        std::filesystem::remove(attempt_filename, error);
+        return false;
+    }
+    Metrics::add(Counter::REDUCE_TASKS, 1);
+    Metrics::add(Counter::REDUCE_OUTPUT_RECORDS, reply.partial() ? 0 : final_output.records());
+    return true;
+}
+
+// Metrics of the worker that have not been sent to the coordinator yet. Every CompleteRequest
+// carries those of all the slots, not only of the task that completed.
+std::mutex reported_metrics_mutex;
+mapreduce::MetricValues reported_metrics;
+
+mapreduce::MetricValues unreported_metrics() {
+    std::lock_guard<std::mutex> lock(reported_metrics_mutex);
+    mapreduce::MetricValues metrics = Metrics::snapshot();
+    mapreduce::MetricValues unreported = metrics.since(reported_metrics);
+    reported_metrics = metrics;
+    return unreported;
+}
+
+// Run tasks until the coordinator reports that the job has finished. Every slot of the worker
+// runs this loop on its own thread. An attempt that fails is reported to the coordinator, which
+// runs its task again, and the slot goes on with the next task.
+void run_slot(CoordinatorClient& client, const std::string& worker_id, const std::string& host) {
+    for (;;) {
+        AssignReply reply = client.Assign(worker_id, host, cached_inputs);
+        if (reply.taskname() == "done") {
+            std::cout << "MapReduce job has completed" << std::endl;
+            return;
+        }
+
+        // Call the map or reduce function, while sending heartbeats to the coordinator
+        std::string taskname = reply.taskname();
+        MapOutputStats stats;
+        bool ok;
+        bool cancelled;
+        {
+            TaskHeartbeat heartbeat(client, worker_id, reply);
+            // A user function that throws, such as a typed job decoding bytes of another type,
+            // fails the attempt like any other error
+            try {
+                if (taskname == "map") {
+                    ok = run_map_task(reply, heartbeat.cancelled, stats);
+                    // Reducers may fetch the intermediate files as soon as the Complete RPC is accepted
+                    if (ok && shuffle_service && !heartbeat.cancelled) {
+                        for (uint32_t partition = 0; partition < reply.num_reducers(); partition++) {
+                            shuffle_service->serve(reply.output_filename() + "-" + std::to_string(partition));
+                        }
+                    }
+                } else if (taskname == "reduce") {
+                    ok = run_reduce_task(client, worker_id, reply, heartbeat.cancelled);
+                    // The output of a partial task is fetched by the reduce task of its partition
+                    if (ok && reply.partial() && shuffle_service && !heartbeat.cancelled) {
+                        shuffle_service->serve(reply.output_filename());
+                    }
+                } else {
+                    std::cerr << "Unknown task: " << reply.taskname() << std::endl;
+                    ok = false;
                 }
-                values.push_back(kv.second.c_str());
+            } catch (const std::exception& e) {
+                std::cerr << "Error in " << taskname << " task " << reply.task_id() << ": " << e.what() << std::endl;
+                ok = false;
             }
-            
-            // Write the final key-value pairs to the output file
-            std::ofstream output_file(reply.output_filename());
-            if (!output_file.is_open()) {
-                std::cerr << "Failed to open output file: " << reply.output_filename() << std::endl;
-                return 1;
+            cancelled = heartbeat.cancelled;
+        }
+        if (cancelled) {
+            std::cout << "Attempt " << reply.attempt_id() << " of " << taskname << " task " << reply.task_id() << " was cancelled" << std::endl;
+            if (taskname == "map") {
+                remove_map_outputs(reply.output_filename());
             }
-
-            std::cout << "Writing final key-value pairs to " << reply.output_filename() << std::endl;
-            for (const auto& kv : intermediate_final) {
-                output_file << kv.first << "\t" << kv.second << std::endl;
+            continue;
+        }
+        if (!ok) {
+            std::cerr << "Attempt " << reply.attempt_id() << " of " << taskname << " task " << reply.task_id() << " failed" << std::endl;
+            if (taskname == "map") {
+                remove_map_outputs(reply.output_filename());
+            } else if (taskname == "reduce") {
+                remove_reduce_outputs(reply);
             }
-
-            output_file.close();
-        } else {
-            std::cerr << "Unknown task: " << reply.taskname() << std::endl;
-            return 1;
+            CompleteReply complete_reply = client.Complete(worker_id, reply.taskname(), reply.task_id(), reply.attempt_id(), reply.output_filename(),
+                                                           "", unreported_metrics(), stats, true);
+            if (complete_reply.job_finished()) {
+                std::cout << "MapReduce job has completed" << std::endl;
+                return;
+            }
+            continue;
         }
         
         // Send Complete RPC to the coordinator
-        std::cout << "Sending Complete RPC to the coordinator" << std::endl;
-        CompleteReply complete_reply = client.Complete(worker_id, reply.taskname(), reply.output_filename());
+        if (verbose) {
+            std::cout << "Sending Complete RPC to the coordinator" << std::endl;
+        }
+        const bool serves_output = taskname == "map" || reply.partial();
+        CompleteReply complete_reply = client.Complete(worker_id, reply.taskname(), reply.task_id(), reply.attempt_id(), reply.output_filename(),
+                                                       serves_output ? shuffle_address : "", unreported_metrics(), stats);
         
-        std::cout << "Complete RPC returned " << std::endl;
+        if (verbose) {
+            std::cout << "Complete RPC returned " << std::endl;
+        }
+        if (!complete_reply.accepted()) {
+            // Another attempt completed the task first, and its output is the one that is used
+            std::cout << "Attempt " << reply.attempt_id() << " of " << taskname << " task " << reply.task_id() << " was not accepted" << std::endl;
+            if (taskname == "map") {
+                if (shuffle_service) {
+                    for (uint32_t partition = 0; partition < reply.num_reducers(); partition++) {
+                        shuffle_service->stopServing(reply.output_filename() + "-" + std::to_string(partition));
+                    }
+                }
+                remove_map_outputs(reply.output_filename());
+            }
+        }
+        if (complete_reply.job_finished()) {
+            std::cout << "MapReduce job has completed" << std::endl;
+            return;
+        }
+    }
+}
+  
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 6) {
+        std::cerr << "Usage: " << argv[0] << " <worker_id> <map_reduce_functions.so> [num_slots] [map_threads] [shuffle_address]" << std::endl;
+        return 1;
+    }
+
+    // Number of tasks the worker runs in parallel, 0 runs one per core
+    size_t num_slots = argc >= 4 ? std::stoul(argv[3]) : 1;
+    if (num_slots == 0) {
+        num_slots = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    // Number of threads that map the chunks of a single split, 0 uses one per core
+    size_t map_threads = argc >= 5 ? std::stoul(argv[4]) : 1;
+    if (map_threads == 0) {
+        map_threads = std::max(std::thread::hardware_concurrency(), 1U);
+    }
+    if (map_threads > 1) {
+        map_pool = std::make_unique<mapreduce::ThreadPool>(map_threads);
+    }
+
+    std::string so_filename = argv[2];
+    std::cout << "Loading shared object: " << so_filename << std::endl;
+    
+    void* handle = dlopen(so_filename.c_str(), RTLD_LAZY);
+    if (!handle) {
+        std::cerr << "dlopen() failed: " << dlerror() << std::endl;
+        return 1;
+    }
 
-        // Reset the intermediate key-value store
-        intermediate.clear();
-        intermediate_final.clear();
+    if (!load_user_functions(handle)) {
+        return 1;
+    }
+
+    std::cout << "Loaded map and reduce functions" << std::endl;
+
+    std::string worker_id = argv[1];
+
+    CoordinatorClient client(grpc::CreateChannel("0.0.0.0:8995", grpc::InsecureChannelCredentials()));
+    // The coordinator prefers giving the worker inputs that are already cached on its host
+    char hostname[256] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    const std::string host = hostname;
+
+    // With a shuffle address, the worker serves its intermediate files to the reducers of other
+    // workers instead of relying on a shared filesystem. Port 0 picks a free port.
+    std::unique_ptr<Server> shuffle_server;
+    if (argc >= 6) {
+        std::string listen_address = argv[5];
+        int port = 0;
+        shuffle_service = std::make_unique<ShuffleServiceImpl>();
+        ServerBuilder builder;
+        builder.AddListeningPort(listen_address, grpc::InsecureServerCredentials(), &port);
+        // Accept the keepalive pings of the reducers, see ShuffleClient
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, 5000);
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+        builder.RegisterService(shuffle_service.get());
+        shuffle_server = builder.BuildAndStart();
+        if (!shuffle_server || port == 0) {
+            std::cerr << "Failed to start the shuffle service on " << listen_address << std::endl;
+            return 1;
+        }
+        // A wildcard address is advertised under the host name
+        std::string listen_host = listen_address.substr(0, listen_address.rfind(':'));
+        if (listen_host == "0.0.0.0" || listen_host == "[::]") {
+            listen_host = host;
+        }
+        shuffle_address = listen_host + ":" + std::to_string(port);
+        std::cout << "Serving intermediate files on " << shuffle_address << std::endl;
+    }
+
+    std::cout << "Running " << num_slots << " task slots with " << map_threads << " map threads" << std::endl;
+
+    // Every slot runs one task at a time. The slots share the user functions and the
+    // connection to the coordinator, and each registers as its own worker so that the
+    // coordinator can hand them tasks independently.
+    std::vector<std::thread> slots;
+    for (size_t slot = 0; slot < num_slots; slot++) {
+        std::string slot_id = num_slots == 1 ? worker_id : worker_id + "-" + std::to_string(slot);
+        slots.emplace_back([&client, &host, slot_id] {
+            run_slot(client, slot_id, host);
+        });
+    }
+    for (auto& slot : slots) {
+        slot.join();
+    }
+    if (shuffle_server) {
+        shuffle_server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(1));
     }
 
     return 0;
@@ -0,0 +1,43 @@
+//
+// Checks shared by the unit tests, which only depend on the headers they test.
+//
+
+#pragma once
+
+#ifndef MAPREDUCE_TESTS_CHECK_HPP
+#define MAPREDUCE_TESTS_CHECK_HPP
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+namespace mapreduce::test {
+    inline int failures = 0;
+
+    // Path of a temporary file of the test process
+    inline std::string tempFile(const std::string& name) {
+        return (std::filesystem::temp_directory_path() / ("mr-test-" + std::to_string(getpid()) + "-" + name)).string();
+    }
+
+    // Exit status of a test, non-zero if any check failed
+    inline int result() {
+        if (failures > 0) {
+            std::cerr << failures << " checks failed" << std::endl;
+            return 1;
+        }
+        std::cout << "All checks passed" << std::endl;
+        return 0;
+    }
+}
+
+// A failed check is printed and the test goes on, so that a run shows every failure
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            mapreduce::test::failures++; \
+        } \
+    } while (0)
+
+#endif //MAPREDUCE_TESTS_CHECK_HPP
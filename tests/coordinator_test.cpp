@@ -0,0 +1,230 @@
+//
+// Tests of the coordinator's scheduling. Workers are simulated by calling the handlers of the
+// service directly, without a server.
+//
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/mapreduce.hpp"
+#include "check.hpp"
+
+using namespace std::chrono_literals;
+
+// A job over num_maps splits of a file that is never read, with short leases and long polls
+static std::shared_ptr<JobState> makeJob(size_t num_maps, size_t num_reduces) {
+    auto state = std::make_shared<JobState>();
+    state->num_mappers = num_maps;
+    state->num_reducers = num_reduces;
+    state->segment_size = 10;
+    state->sort_buffer_size = 1024;
+    state->intermediate_checksums = false;
+    state->sorted_output = true;
+    state->shuffle_compression = false;
+    state->compression = mapreduce::Compression::NONE;
+    state->num_segments = num_maps;
+    state->reduce_slowstart = 0;
+    state->merge_factor = 2;
+    state->task_lease = 200ms;
+    state->long_poll_timeout = 20ms;
+    state->speculative_execution = false;
+    state->speculation_slowness = 1.5;
+    state->skew_threshold = 0;
+    state->max_partition_splits = 1;
+    state->partition_records.assign(num_reduces, 0);
+    state->partition_bytes.assign(num_reduces, 0);
+    state->start_time = Clock::now();
+    for (size_t i = 0; i < num_maps; i++) {
+        MapTask task;
+        task.state = TaskState::IDLE;
+        task.id = i;
+        task.split = {"input", i * 10, 10};
+        task.output_filename = "mr-int-" + std::to_string(i);
+        task.idle_since = state->start_time;
+        state->map_tasks.push_back(task);
+        state->idle_map_tasks.push_back(i);
+        state->idle_map_tasks_by_file["input"].push_back(i);
+        state->num_idle_map_tasks++;
+    }
+    for (size_t i = 0; i < num_reduces; i++) {
+        ReduceTask task;
+        task.state = TaskState::IDLE;
+        task.id = i;
+        task.partition = i;
+        task.output_filename = "mr-out-" + std::to_string(i);
+        task.idle_since = state->start_time;
+        state->reduce_tasks.push_back(task);
+        state->idle_reduce_tasks.push_back(i);
+    }
+    return state;
+}
+
+// Requests of a simulated worker
+struct Worker {
+    MapReduceServiceImpl& service;
+    std::string id;
+
+    AssignReply assign() {
+        AssignRequest request;
+        AssignReply reply;
+        request.set_worker_id(this->id);
+        request.set_host("host");
+        CHECK(this->service.Assign(nullptr, &request, &reply).ok());
+        return reply;
+    }
+
+    CompleteReply complete(const AssignReply& task, bool failed = false) {
+        CompleteRequest request;
+        CompleteReply reply;
+        request.set_worker_id(this->id);
+        request.set_taskname(task.taskname());
+        request.set_task_id(task.task_id());
+        request.set_attempt_id(task.attempt_id());
+        request.set_output_filename(task.output_filename());
+        request.set_shuffle_address(this->id + ":1");
+        request.set_failed(failed);
+        CHECK(this->service.Complete(nullptr, &request, &reply).ok());
+        return reply;
+    }
+
+    // Reports the output of the map tasks lost_maps, run by the worker lost_worker, as lost
+    MapOutputsReply mapOutputs(const AssignReply& task, uint32_t start, const std::vector<uint32_t>& lost_maps = {},
+                               const std::string& lost_worker = "") {
+        MapOutputsRequest request;
+        MapOutputsReply reply;
+        request.set_worker_id(this->id);
+        request.set_task_id(task.task_id());
+        request.set_attempt_id(task.attempt_id());
+        request.set_start(start);
+        for (uint32_t map_task_id : lost_maps) {
+            auto* lost = request.add_lost_map_output();
+            lost->set_map_task_id(map_task_id);
+            lost->set_shuffle_address(lost_worker + ":1");
+        }
+        CHECK(this->service.MapOutputs(nullptr, &request, &reply).ok());
+        return reply;
+    }
+
+    // Returns true if the attempt was cancelled
+    bool heartbeat(const AssignReply& task) {
+        HeartbeatRequest request;
+        HeartbeatReply reply;
+        request.set_worker_id(this->id);
+        request.set_taskname(task.taskname());
+        request.set_task_id(task.task_id());
+        request.set_attempt_id(task.attempt_id());
+        CHECK(this->service.Heartbeat(nullptr, &request, &reply).ok());
+        return reply.cancel();
+    }
+};
+
+// Workers a and c run the two reduce tasks, which wait for map task 1 whose output on worker b
+// was lost. Worker b had no task, and died without asking for another one.
+static void testPreemptWhenIdleWorkerDies() {
+    auto state = makeJob(2, 2);
+    MapReduceServiceImpl service(state);
+    Worker a{service, "a"}, b{service, "b"}, c{service, "c"};
+
+    const AssignReply map_a = a.assign(), map_b = b.assign();
+    CHECK(map_a.taskname() == "map" && map_b.taskname() == "map");
+    CHECK(map_b.task_id() == 1);
+    a.complete(map_a);
+    b.complete(map_b);
+    const AssignReply reduce_a = a.assign();
+    std::this_thread::sleep_for(5ms);
+    const AssignReply reduce_c = c.assign();
+    CHECK(reduce_a.taskname() == "reduce" && reduce_c.taskname() == "reduce");
+    // Nothing is left for b, which then stops sending requests
+    CHECK(b.assign().taskname() == "wait");
+
+    CHECK(a.mapOutputs(reduce_a, 0).complete());
+    const MapOutputsReply lost = a.mapOutputs(reduce_a, 2, {1}, "b");
+    CHECK(!lost.complete() && !lost.cancelled());
+    CHECK(state->map_tasks[1].state == TaskState::IDLE);
+
+    // b was heard from within a lease, and may still take the map task
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        service.expireAttempts();
+    }
+    CHECK(state->reduce_tasks[0].state == TaskState::IN_PROGRESS);
+    CHECK(state->reduce_tasks[1].state == TaskState::IN_PROGRESS);
+
+    // Once b is presumed dead, the reduce attempt that started last is cancelled
+    for (size_t i = 0; i < 5; i++) {
+        std::this_thread::sleep_for(state->task_lease / 4);
+        CHECK(!a.heartbeat(reduce_a));
+        CHECK(!c.heartbeat(reduce_c));
+    }
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        service.expireAttempts();
+    }
+    CHECK(state->reduce_tasks[0].state == TaskState::IN_PROGRESS);
+    CHECK(state->reduce_tasks[1].state == TaskState::IDLE);
+    CHECK(c.heartbeat(reduce_c));
+
+    // c is free to take the map task, so no other reduce attempt is cancelled meanwhile
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        service.expireAttempts();
+    }
+    CHECK(state->reduce_tasks[0].state == TaskState::IN_PROGRESS);
+    const AssignReply rerun = c.assign();
+    CHECK(rerun.taskname() == "map" && rerun.task_id() == 1);
+}
+
+// A failed attempt puts its task back in the idle queue, until the task failed too many times
+static void testFailedAttempts() {
+    auto state = makeJob(1, 1);
+    state->max_task_failures = 3;
+    MapReduceServiceImpl service(state);
+    Worker a{service, "a"}, b{service, "b"};
+
+    const AssignReply first = a.assign();
+    CHECK(first.taskname() == "map" && first.task_id() == 0);
+    const CompleteReply failed = a.complete(first, true);
+    CHECK(!failed.accepted() && !failed.job_finished());
+    CHECK(state->map_tasks[0].state == TaskState::IDLE);
+    CHECK(state->num_in_progress_map_tasks == 0);
+
+    const AssignReply second = b.assign();
+    CHECK(second.taskname() == "map" && second.task_id() == 0 && second.attempt_id() == 1);
+    const CompleteReply completed = b.complete(second);
+    CHECK(completed.accepted());
+    CHECK(state->map_tasks[0].state == TaskState::COMPLETE);
+
+    // The reduce task fails on every attempt
+    for (uint32_t attempt = 0; attempt < 3; attempt++) {
+        const AssignReply reduce = a.assign();
+        CHECK(reduce.taskname() == "reduce" && reduce.attempt_id() == attempt);
+        const CompleteReply reply = a.complete(reduce, true);
+        CHECK(!reply.accepted());
+        CHECK(reply.job_finished() == (attempt == 2));
+    }
+    CHECK(state->failed && state->finished);
+    CHECK(a.assign().taskname() == "done");
+}
+
+// Map tasks only sample their keys if the job splits skewed partitions
+static void testSampleKeys() {
+    for (double skew_threshold : {0.0, 2.0}) {
+        auto state = makeJob(1, 1);
+        state->skew_threshold = skew_threshold;
+        MapReduceServiceImpl service(state);
+        Worker a{service, "a"};
+        const AssignReply map = a.assign();
+        CHECK(map.taskname() == "map");
+        CHECK(map.sample_keys() == (skew_threshold > 0));
+    }
+}
+
+int main() {
+    testPreemptWhenIdleWorkerDies();
+    testFailedAttempts();
+    testSampleKeys();
+    return mapreduce::test::result();
+}
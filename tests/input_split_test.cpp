@@ -0,0 +1,54 @@
+//
+// Tests of the alignment of input splits to line boundaries.
+//
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include "../include/input_split.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+
+// Every split size over a file, so that the splits start and end before, on, and after every newline
+static void checkEveryLineOnce(const std::string& file) {
+    for (uint64_t length = 1; length <= file.size() + 1; length++) {
+        std::string joined;
+        for (uint64_t offset = 0; offset < file.size(); offset += length) {
+            const std::string_view records = splitRecords(file, offset, length);
+            // A split only holds whole lines
+            CHECK(records.empty() || records.data() == file.data() || records.data()[-1] == '\n');
+            CHECK(records.empty() || records.data() + records.size() == file.data() + file.size() || records.back() == '\n');
+            joined += records;
+        }
+        // Every line is in exactly one split, in order
+        CHECK(joined == file);
+    }
+}
+
+static void testEveryLineOnce() {
+    checkEveryLineOnce("alpha\nbeta\n\ngamma delta\nepsilon");
+    checkEveryLineOnce("alpha\nbeta\n");
+    checkEveryLineOnce("\n\n\n");
+    checkEveryLineOnce("a line longer than most of the splits\nb\n");
+    checkEveryLineOnce("");
+}
+
+static void testStraddlingLines() {
+    const std::string file = "alpha\nbeta\n\ngamma delta\nepsilon";
+    // A line that straddles a boundary belongs to the split it starts in
+    CHECK(splitRecords(file, 0, 3) == "alpha\n");
+    CHECK(splitRecords(file, 3, 5) == "beta\n");
+    CHECK(splitRecords(file, 6, 1) == "beta\n");
+    CHECK(splitRecords(file, 7, 4) == "");
+    CHECK(splitRecords(file, 7, 5) == "\n");
+    CHECK(splitRecords(file, 24, 100) == "epsilon");
+    CHECK(splitRecords(file, 25, 100) == "");
+    CHECK(splitRecords(file, file.size(), 10) == "");
+}
+
+int main() {
+    testEveryLineOnce();
+    testStraddlingLines();
+    return mapreduce::test::result();
+}
@@ -0,0 +1,101 @@
+//
+// Tests of the intermediate file format: records read back as written, and damaged files are reported.
+//
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../include/intermediate.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+using mapreduce::test::tempFile;
+
+using Records = std::vector<std::pair<std::string, std::string>>;
+
+static Records readRecords(const std::string& filename) {
+    Records records;
+    RecordReader reader(filename);
+    while (reader.next()) {
+        records.emplace_back(reader.key(), reader.value());
+    }
+    return records;
+}
+
+// Returns the message of the exception thrown while reading a file, empty if there was none
+static std::string readError(const std::string& filename) {
+    try {
+        readRecords(filename);
+    } catch (const std::exception& e) {
+        return e.what();
+    }
+    return "";
+}
+
+static bool writeRecords(const std::string& filename, const Records& records, WriterOptions options) {
+    RecordWriter writer(filename, options);
+    for (const auto& [key, value] : records) {
+        writer.write(key, value);
+    }
+    return writer.is_open() && writer.close() && writer.records() == records.size();
+}
+
+static void testRoundTrip() {
+    Records records;
+    for (int i = 0; i < 5000; i++) {
+        // Repetitive values, so that compressed blocks actually shrink
+        records.emplace_back("key" + std::to_string(i), std::string(i % 50, 'a' + i % 26));
+    }
+    records.emplace_back("", "");
+    records.emplace_back(std::string("\0\n\xff", 3), std::string(100000, 'x')); // Larger than a block
+
+    for (Compression compression : {Compression::NONE, Compression::LZ4, Compression::ZSTD, Compression::ZLIB}) {
+        if (!compressionAvailable(compression)) {
+            continue;
+        }
+        for (bool checksums : {false, true}) {
+            const std::string filename = tempFile(std::string("records-") + compressionName(compression));
+            const WriterOptions options{.checksums = checksums, .block_size = 4096, .compression = compression};
+            CHECK(writeRecords(filename, records, options));
+            CHECK(readRecords(filename) == records);
+
+            // Cut in the middle of the last block
+            std::filesystem::resize_file(filename, std::filesystem::file_size(filename) - 10);
+            CHECK(readError(filename).find("truncated") != std::string::npos);
+
+            // Flip a byte of the first block's payload, past the file and block headers
+            if (checksums) {
+                CHECK(writeRecords(filename, records, options));
+                std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+                file.seekg(64);
+                char byte = 0;
+                file.get(byte);
+                file.seekp(64);
+                file.put(static_cast<char>(byte ^ 0x5a));
+                file.close();
+                CHECK(readError(filename).find("checksum mismatch") != std::string::npos);
+            }
+            std::filesystem::remove(filename);
+        }
+    }
+}
+
+static void testEmptyFile() {
+    const std::string filename = tempFile("empty");
+    CHECK(writeRecords(filename, {}, {}));
+    CHECK(readRecords(filename).empty());
+    std::filesystem::remove(filename);
+
+    // A missing file is not open, rather than empty
+    CHECK(!RecordReader(filename).is_open());
+}
+
+int main() {
+    testRoundTrip();
+    testEmptyFile();
+    return mapreduce::test::result();
+}
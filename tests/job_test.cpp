@@ -0,0 +1,109 @@
+//
+// Tests of the serializers of typed jobs, and of the order of their final output.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../include/final_output.hpp"
+#include "../include/intermediate.hpp"
+#include "../include/job.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+using mapreduce::test::tempFile;
+
+// Encoded values decode to themselves, and compare as bytes in the same order as the values
+template <typename T>
+static void checkSerializerOrder(std::vector<T> values) {
+    std::sort(values.begin(), values.end());
+    std::string buffer;
+    std::vector<std::string> encoded;
+    for (const T& value : values) {
+        encoded.emplace_back(Serializer<T>::encode(value, buffer));
+        CHECK(Serializer<T>::decode(encoded.back()) == value);
+    }
+    for (size_t i = 1; i < encoded.size(); i++) {
+        CHECK((values[i - 1] < values[i]) == (encoded[i - 1] < encoded[i]));
+        CHECK((values[i - 1] == values[i]) == (encoded[i - 1] == encoded[i]));
+    }
+}
+
+static void testSerializers() {
+    checkSerializerOrder<int8_t>({-128, -1, 0, 1, 127});
+    checkSerializerOrder<int32_t>({std::numeric_limits<int32_t>::min(), -65536, -256, -255, -1, 0, 1, 255, 256, 65536,
+                                   std::numeric_limits<int32_t>::max()});
+    checkSerializerOrder<int64_t>({std::numeric_limits<int64_t>::min(), -(int64_t(1) << 40), -1, 0, 1, int64_t(1) << 40,
+                                   std::numeric_limits<int64_t>::max()});
+    checkSerializerOrder<uint32_t>({0, 1, 255, 256, std::numeric_limits<uint32_t>::max()});
+    checkSerializerOrder<double>({-std::numeric_limits<double>::infinity(), -1e300, -1.5, -0.25, 0.0, 0.25, 1.5, 1e300,
+                                  std::numeric_limits<double>::infinity()});
+    checkSerializerOrder<std::string>({"", "a", "ab", "b", std::string("a\0", 2), "\xff", "z"});
+
+    std::string buffer;
+    CHECK(Serializer<int32_t>::format(-42, buffer) == "-42");
+}
+
+static bool decodeThrows(std::string_view bytes) {
+    try {
+        Serializer<int32_t>::decode(bytes);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+// Bytes of the wrong width, such as a value of another type, fail instead of decoding to 0
+static void testDecodeWrongWidth() {
+    std::string buffer;
+    CHECK(!decodeThrows(Serializer<int32_t>::encode(7, buffer)));
+    CHECK(decodeThrows(""));
+    CHECK(decodeThrows("abc"));
+    CHECK(decodeThrows(Serializer<int64_t>::encode(7, buffer)));
+    bool threw = false;
+    try {
+        Serializer<double>::decode("abc");
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+// The reduce outputs of a job with integer keys merge in the order of the values, not of
+// their text
+static void testFinalOutputOrder() {
+    const std::vector<std::vector<int32_t>> outputs = {{-10, 2, 9, 100}, {-3, 10, 11}};
+    std::vector<std::string> filenames;
+    for (const auto& keys : outputs) {
+        filenames.push_back(tempFile("out-" + std::to_string(filenames.size())));
+        RecordWriter writer(filenames.back(), WriterOptions{});
+        std::string buffer, text, line;
+        for (int32_t key : keys) {
+            outputLine(line, Serializer<int32_t>::format(key, text), "1");
+            writer.write(Serializer<int32_t>::encode(key, buffer), line);
+        }
+        CHECK(writer.close());
+    }
+
+    std::ostringstream merged;
+    CHECK(writeFinalOutput(filenames, merged, false));
+    CHECK(merged.str() == "-10\t1\n-3\t1\n2\t1\n9\t1\n10\t1\n11\t1\n100\t1\n");
+    std::ostringstream concatenated;
+    CHECK(writeFinalOutput(filenames, concatenated, true));
+    CHECK(concatenated.str() == "-10\t1\n2\t1\n9\t1\n100\t1\n-3\t1\n10\t1\n11\t1\n");
+    for (const auto& filename : filenames) {
+        std::filesystem::remove(filename);
+    }
+}
+
+int main() {
+    testSerializers();
+    testDecodeWrongWidth();
+    testFinalOutputOrder();
+    return mapreduce::test::result();
+}
@@ -0,0 +1,114 @@
+//
+// Tests of the bounded map output buffer: spills, the merge of its runs, and combining.
+//
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../include/intermediate.hpp"
+#include "../include/map_output_buffer.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+using mapreduce::test::tempFile;
+
+constexpr size_t num_partitions = 3;
+constexpr size_t num_keys = 500;
+
+// Adds every key of [0, num_keys) count times with the value "1", key i to partition i % num_partitions
+static void addRecords(MapOutputBuffer& buffer, size_t count) {
+    for (size_t i = 0; i < count * num_keys; i++) {
+        const size_t key = i * 7919 % num_keys;
+        buffer.add(key % num_partitions, "key" + std::to_string(key), "1");
+    }
+}
+
+// Sums the values of every key of the intermediate files, returns false if a partition is not sorted
+static bool readPartitions(const std::string& prefix, const MapOutputBuffer& buffer, std::map<std::string, size_t>& sums) {
+    bool sorted = true;
+    for (size_t p = 0; p < num_partitions; p++) {
+        RecordReader reader(prefix + "-" + std::to_string(p));
+        CHECK(reader.is_open());
+        std::string previous;
+        size_t records = 0;
+        while (reader.next()) {
+            sorted = sorted && (records == 0 || previous <= reader.key());
+            previous = reader.key();
+            sums[previous] += std::stoul(std::string(reader.value()));
+            records++;
+        }
+        CHECK(records == buffer.written(p));
+    }
+    return sorted;
+}
+
+static void removePartitions(const std::string& prefix) {
+    for (size_t p = 0; p < num_partitions; p++) {
+        std::filesystem::remove(prefix + "-" + std::to_string(p));
+    }
+}
+
+static void testSpillAndMerge() {
+    const std::string prefix = tempFile("buffer");
+    MapOutputBuffer buffer(prefix, num_partitions, 16 * 1024, WriterOptions{});
+    addRecords(buffer, 20);
+    CHECK(buffer.finish());
+    CHECK(buffer.spills() > 1);
+    CHECK(buffer.added() == 20 * num_keys);
+    CHECK(buffer.written() == buffer.added());
+
+    std::map<std::string, size_t> sums;
+    CHECK(readPartitions(prefix, buffer, sums));
+    CHECK(sums.size() == num_keys);
+    CHECK(std::all_of(sums.begin(), sums.end(), [](const auto& sum) { return sum.second == 20; }));
+    removePartitions(prefix);
+}
+
+static void testCombiner() {
+    const std::string prefix = tempFile("combined");
+    auto combiner = [](std::string_view key, const std::vector<std::string_view>& values, RecordWriter& writer) {
+        size_t sum = 0;
+        for (const auto& value : values) {
+            sum += std::stoul(std::string(value));
+        }
+        writer.write(key, std::to_string(sum));
+    };
+    MapOutputBuffer buffer(prefix, num_partitions, 16 * 1024, WriterOptions{}, combiner);
+    addRecords(buffer, 20);
+    CHECK(buffer.finish());
+    // Every key is combined into a single record
+    CHECK(buffer.written() == num_keys);
+
+    std::map<std::string, size_t> sums;
+    CHECK(readPartitions(prefix, buffer, sums));
+    CHECK(sums.size() == num_keys);
+    CHECK(std::all_of(sums.begin(), sums.end(), [](const auto& sum) { return sum.second == 20; }));
+    removePartitions(prefix);
+}
+
+// A run that is gone fails the task instead of throwing
+static void testMissingRun() {
+    const std::string prefix = tempFile("missing");
+    MapOutputBuffer buffer(prefix, num_partitions, 16 * 1024, WriterOptions{});
+    addRecords(buffer, 20);
+    CHECK(buffer.flush());
+    CHECK(std::filesystem::remove(prefix + "-0.spill-0"));
+    CHECK(!buffer.finish());
+
+    const std::string dir = std::filesystem::path(prefix).parent_path().string();
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().filename().string().starts_with(std::filesystem::path(prefix).filename().string())) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+}
+
+int main() {
+    testSpillAndMerge();
+    testCombiner();
+    testMissingRun();
+    return mapreduce::test::result();
+}
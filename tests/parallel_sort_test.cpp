@@ -0,0 +1,105 @@
+//
+// Tests of the parallel sort of the map output, and of merging runs sorted in hash order.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "../include/intermediate.hpp"
+#include "../include/parallel_sort.hpp"
+#include "../include/thread_pool.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+using mapreduce::test::tempFile;
+
+static void testSameAsSort() {
+    ThreadPool pool(4);
+    std::mt19937_64 random(42);
+    for (size_t size : {0, 1, 2, 3, 7, 1000, 100003}) {
+        std::vector<std::pair<uint32_t, uint32_t>> items;
+        for (size_t i = 0; i < size; i++) {
+            // Few distinct keys, so that there are many ties across ranges
+            items.emplace_back(random() % 97, static_cast<uint32_t>(i));
+        }
+        const auto by_key = [](const auto& a, const auto& b) { return a.first < b.first; };
+
+        auto expected = items;
+        std::sort(expected.begin(), expected.end());
+        for (ThreadPool* p : {&pool, static_cast<ThreadPool*>(nullptr)}) {
+            auto sorted = items;
+            parallelSort(p, sorted, std::less<>(), 16);
+            CHECK(sorted == expected);
+
+            // Ties may come in any order, but the keys are sorted and no item is lost
+            auto by_key_sorted = items;
+            parallelSort(p, by_key_sorted, by_key, 16);
+            CHECK(std::is_sorted(by_key_sorted.begin(), by_key_sorted.end(), by_key));
+            std::sort(by_key_sorted.begin(), by_key_sorted.end());
+            CHECK(by_key_sorted == expected);
+        }
+    }
+}
+
+// Runs sorted in either order merge into a single run in that order, in which the records of
+// a key are contiguous
+static void testMergeOrder() {
+    std::mt19937_64 random(7);
+    for (KeyOrder order : {KeyOrder::BYTES, KeyOrder::HASH}) {
+        const auto less = [order](const std::string& a, const std::string& b) {
+            const uint64_t prefix_a = orderPrefix(order, a), prefix_b = orderPrefix(order, b);
+            return prefix_a != prefix_b ? prefix_a < prefix_b : a < b;
+        };
+        std::map<std::string, size_t> counts;
+        std::vector<std::string> filenames;
+        for (size_t run = 0; run < 5; run++) {
+            std::vector<std::string> keys;
+            for (size_t i = 0; i < 2000; i++) {
+                keys.push_back("key" + std::to_string(random() % 300));
+                counts[keys.back()]++;
+            }
+            std::sort(keys.begin(), keys.end(), less);
+            filenames.push_back(tempFile("run-" + std::to_string(run)));
+            RecordWriter writer(filenames.back(), WriterOptions{.key_order = order});
+            for (const auto& key : keys) {
+                writer.write(key, "1");
+            }
+            CHECK(writer.close());
+        }
+
+        std::vector<std::unique_ptr<RecordSource>> sources;
+        for (const auto& filename : filenames) {
+            sources.push_back(std::make_unique<RecordReader>(filename));
+        }
+        MergeIterator merge(std::move(sources), order);
+        std::string previous;
+        std::map<std::string, size_t> merged_counts;
+        bool sorted = true;
+        while (merge.next()) {
+            const std::string key(merge.key());
+            sorted = sorted && (merged_counts.empty() || !less(key, previous));
+            // A key that was already passed would show up again out of order
+            CHECK(key == previous || !merged_counts.contains(key));
+            merged_counts[key]++;
+            previous = key;
+        }
+        CHECK(sorted);
+        CHECK(merged_counts == counts);
+        for (const auto& filename : filenames) {
+            std::filesystem::remove(filename);
+        }
+    }
+}
+
+int main() {
+    testSameAsSort();
+    testMergeOrder();
+    return mapreduce::test::result();
+}
@@ -0,0 +1,81 @@
+//
+// Tests of the heavy hitters sketch and of the planning of partition splits.
+//
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "../include/skew.hpp"
+#include "check.hpp"
+
+using namespace mapreduce;
+
+// A Zipf-like stream over many more keys than the sketch holds, so that keys are replaced
+// all the time
+static void testHeavyHitters() {
+    HeavyHitters sketch(16);
+    std::map<std::string, uint64_t> counts;
+    std::mt19937_64 random(3);
+    uint64_t total = 0;
+    for (size_t i = 0; i < 20000; i++) {
+        const size_t rank = random() % 2 == 0 ? random() % 4 : random() % 1000;
+        const std::string key = "key" + std::to_string(rank);
+        sketch.add(key, static_cast<uint32_t>(rank % 3));
+        counts[key]++;
+        total++;
+    }
+
+    const auto top = sketch.top(16);
+    CHECK(top.size() == 16);
+    uint64_t sum = 0;
+    uint64_t min_count = top.back().count;
+    for (const auto& entry : top) {
+        sum += entry.count;
+        // Counts are overestimated by at most the smallest tracked count
+        CHECK(entry.count >= counts[entry.key]);
+        CHECK(entry.count <= counts[entry.key] + min_count);
+    }
+    // Every added key counts for a tracked key
+    CHECK(sum == total);
+    // Keys above total / capacity are tracked, with their partition
+    for (size_t rank = 0; rank < 4; rank++) {
+        bool found = false;
+        for (size_t i = 0; i < 4; i++) {
+            found = found || (top[i].key == "key" + std::to_string(rank) && top[i].partition == rank % 3);
+        }
+        CHECK(found);
+    }
+}
+
+static void testMerge() {
+    HeavyHitters a(4), b(4);
+    for (size_t i = 0; i < 100; i++) {
+        a.add("hot", 1);
+        b.add("hot", 1);
+        b.add("cold" + std::to_string(i), 2);
+    }
+    a.merge(b);
+    const auto top = a.top(1);
+    CHECK(top.size() == 1);
+    CHECK(top[0].key == "hot" && top[0].count >= 200 && top[0].partition == 1);
+}
+
+static void testPlanPartitionSplits() {
+    CHECK((planPartitionSplits({10, 10, 10, 10}, 1.5, 4) == std::vector<size_t>{1, 1, 1, 1}));
+    // The mean is 25, so the large partition is split into shares of about that size
+    CHECK((planPartitionSplits({70, 10, 10, 10}, 1.5, 4) == std::vector<size_t>{3, 1, 1, 1}));
+    CHECK((planPartitionSplits({970, 10, 10, 10}, 1.5, 4) == std::vector<size_t>{4, 1, 1, 1}));
+    // Off, empty, or nothing emitted yet
+    CHECK((planPartitionSplits({70, 10, 10, 10}, 0, 4) == std::vector<size_t>{1, 1, 1, 1}));
+    CHECK(planPartitionSplits({}, 1.5, 4).empty());
+    CHECK((planPartitionSplits({0, 0}, 1.5, 4) == std::vector<size_t>{1, 1}));
+}
+
+int main() {
+    testHeavyHitters();
+    testMerge();
+    testPlanPartitionSplits();
+    return mapreduce::test::result();
+}